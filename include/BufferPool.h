@@ -0,0 +1,112 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/// <summary>
+/// Per-thread pool of aligned I/O buffers in a few size classes, so that the copy paths do not allocate once every
+/// worker has touched each class. All buffers are aligned for O_DIRECT. Buffers of the largest class can be backed
+/// by 2 MiB huge pages, explicit ones if the system has reserved them and transparent ones otherwise, which saves
+/// TLB misses on long sequential copies.
+/// </summary>
+class BufferPool
+{
+public:
+	enum class SizeClass
+	{
+		/// <summary>
+		/// files below 1 MiB, a single read usually covers them
+		/// </summary>
+		Small,
+		/// <summary>
+		/// files below 64 MiB
+		/// </summary>
+		Medium,
+		/// <summary>
+		/// everything bigger
+		/// </summary>
+		Large,
+		Count,
+	};
+
+	static constexpr size_t Alignment = 4096;
+	static constexpr size_t HugePageSize = 2 * 1024 * 1024;
+	/// <summary>
+	/// free buffers kept per size class, a copy path needs at most one at a time
+	/// </summary>
+	static constexpr size_t MaxFree = 2;
+
+private:
+	struct Block
+	{
+		char* data = nullptr;
+		/// <summary>
+		/// allocated with mmap instead of the heap
+		/// </summary>
+		bool mapped = false;
+	};
+
+	std::vector<Block> _free[(int)SizeClass::Count];
+
+	static std::atomic<bool> _hugePages;
+	static std::atomic<uint64_t> _allocations;
+	static std::atomic<uint64_t> _hugeAllocations;
+
+	static Block Allocate(SizeClass size);
+	static void Free(SizeClass size, Block block);
+
+public:
+	/// <summary>
+	/// Buffer borrowed from a pool, it goes back to the pool when it is destroyed
+	/// </summary>
+	class Buffer
+	{
+	private:
+		friend class BufferPool;
+
+		BufferPool* _pool = nullptr;
+		Block _block;
+		SizeClass _size = SizeClass::Small;
+
+	public:
+		Buffer() = default;
+		Buffer(Buffer&& other) noexcept;
+		Buffer& operator=(Buffer&& other) noexcept;
+		~Buffer();
+
+		char* Data() { return _block.data; }
+		size_t Size() { return GetSize(_size); }
+	};
+
+	BufferPool() = default;
+	~BufferPool();
+
+	BufferPool(const BufferPool&) = delete;
+	BufferPool& operator=(const BufferPool&) = delete;
+
+	/// <summary>
+	/// Returns the pool of the calling thread
+	/// </summary>
+	static BufferPool& Local();
+
+	/// <summary>
+	/// Returns the size class for copying a file of [fileSize] bytes
+	/// </summary>
+	static SizeClass Classify(uint64_t fileSize);
+
+	static size_t GetSize(SizeClass size);
+
+	Buffer Acquire(SizeClass size);
+
+	/// <summary>
+	/// Backs the buffers of the largest class that are allocated from now on with huge pages
+	/// </summary>
+	static void SetHugePages(bool enabled);
+
+	/// <summary>
+	/// Returns the number of buffers that have been allocated instead of reused, and how many of them use huge pages
+	/// </summary>
+	static uint64_t GetAllocations();
+	static uint64_t GetHugePageAllocations();
+};
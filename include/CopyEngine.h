@@ -0,0 +1,341 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/// <summary>
+/// Copies the content of single files.
+/// On linux the data is moved with copy_file_range in large chunks, which lets the kernel and the filesystem copy
+/// in place (reflinks, nfs server side copies), and falls back to sendfile and a plain read/write loop where that is
+/// not supported. Other platforms use std::filesystem::copy_file. Statistics are kept per method.
+/// Depending on the reflink mode the destination is first cloned from the source with FICLONE, which shares the
+/// data blocks on filesystems like btrfs and xfs instead of copying them.
+/// </summary>
+class CopyEngine
+{
+public:
+	enum class Method
+	{
+		Clone,
+		CopyFileRange,
+		SendFile,
+		ReadWrite,
+		/// <summary>
+		/// aligned reads and writes with O_DIRECT, past the page cache
+		/// </summary>
+		Direct,
+		/// <summary>
+		/// buffered reads and writes, the copied range is dropped from the page cache behind the cursor
+		/// </summary>
+		DropBehind,
+		/// <summary>
+		/// only the data ranges of a sparse file, the holes are recreated. Counts the bytes actually copied.
+		/// </summary>
+		Sparse,
+		/// <summary>
+		/// only the blocks that differ from the existing destination are rewritten in place. Counts the bytes written.
+		/// </summary>
+		Delta,
+		/// <summary>
+		/// only the tail behind an existing destination that is a prefix of the source. Counts the bytes appended.
+		/// </summary>
+		Append,
+		Generic,
+		Count,
+	};
+
+	/// <summary>
+	/// bytes requested from copy_file_range and sendfile per call
+	/// </summary>
+	static constexpr size_t ChunkSize = 128 * 1024 * 1024;
+	/// <summary>
+	/// alignment of buffers, offsets and lengths for O_DIRECT
+	/// </summary>
+	static constexpr size_t DirectAlignment = 4096;
+	/// <summary>
+	/// bytes written before the drop-behind copy flushes and drops them from the page cache
+	/// </summary>
+	static constexpr uint64_t DropWindow = 8 * 1024 * 1024;
+	/// <summary>
+	/// destinations of at least this size are preallocated before the data is written, smaller files are left to
+	/// the delayed allocation of the filesystem
+	/// </summary>
+	static constexpr uint64_t PreallocateSize = 1024 * 1024;
+	/// <summary>
+	/// granularity of a delta update, a block is rewritten as a whole if any byte in it differs
+	/// </summary>
+	static constexpr size_t DeltaBlockSize = 64 * 1024;
+
+	enum class Reflink
+	{
+		/// <summary>
+		/// clone if the filesystem supports it, copy otherwise
+		/// </summary>
+		Auto,
+		/// <summary>
+		/// fail if a file cannot be cloned
+		/// </summary>
+		Always,
+		/// <summary>
+		/// always copy the data, copy_file_range is skipped since it may clone on its own
+		/// </summary>
+		Never,
+	};
+
+	struct Statistics
+	{
+		std::atomic<uint64_t> files = 0;
+		std::atomic<uint64_t> bytes = 0;
+	};
+
+	/// <summary>
+	/// bytes claimed at once by a thread that copies a part of a split file
+	/// </summary>
+	static constexpr uint64_t SplitChunkSize = 64 * 1024 * 1024;
+
+	/// <summary>
+	/// A file that is copied by several threads at once. The destination is preallocated and every thread claims
+	/// the next chunk of the remaining range until nothing is left, so threads that join late take over parts of
+	/// the range that would otherwise be copied by the threads that are already busy.
+	/// </summary>
+	class Split
+	{
+	private:
+		friend class CopyEngine;
+
+		std::filesystem::path _source;
+		std::filesystem::path _destination;
+		uint64_t _size = 0;
+		uint64_t _chunk = SplitChunkSize;
+#ifdef __linux__
+		int _in = -1;
+		int _out = -1;
+		struct timespec _times[2] = {};
+		unsigned _mode = 0;
+#endif
+		std::atomic<uint64_t> _next = 0;
+		std::atomic<uint64_t> _remaining = 0;
+		std::atomic<int> _error = 0;
+		std::atomic<bool> _fallback = false;
+		bool _dropBehind = false;
+		/// <summary>
+		/// the destination already has the size of the source and is updated in place
+		/// </summary>
+		bool _delta = false;
+		/// <summary>
+		/// the destination has been cloned as a whole, there are no chunks to copy
+		/// </summary>
+		bool _cloned = false;
+		std::atomic<uint64_t> _written = 0;
+
+	public:
+		~Split();
+
+		uint64_t GetSize() { return _size; }
+
+		/// <summary>
+		/// Returns whether all chunks have been taken by a thread
+		/// </summary>
+		bool IsClaimed() { return _next.load() >= std::max<uint64_t>(_size, 1); }
+
+		bool IsCloned() { return _cloned; }
+	};
+
+private:
+	Statistics _statistics[(int)Method::Count];
+	Reflink _reflink = Reflink::Auto;
+	bool _cacheNeutral = false;
+	uint64_t _cacheNeutralSize = 0;
+	uint64_t _dirtyBudget = 0;
+	bool _delta = false;
+	uint64_t _deltaSize = 0;
+	bool _append = false;
+
+#ifdef __linux__
+	/// <summary>
+	/// Rolling writeback behind the write cursor of one destination. Once a window has been written its writeback
+	/// is started and the writeback of the window before is waited for, so at most two windows are dirty.
+	/// </summary>
+	struct Writeback
+	{
+		int out = -1;
+		/// <summary>
+		/// 0 leaves the writeback to the kernel
+		/// </summary>
+		uint64_t window = 0;
+		uint64_t started = 0;
+		uint64_t waited = 0;
+
+		Writeback(int out, uint64_t window, uint64_t offset);
+
+		/// <summary>
+		/// Limits the length of a single call so that the window can be kept
+		/// </summary>
+		size_t Limit(size_t length);
+		void Advance(uint64_t offset);
+		/// <summary>
+		/// Starts the writeback of the rest, without waiting for it
+		/// </summary>
+		void Finish(uint64_t offset);
+	};
+
+	/// <summary>
+	/// Reserves [size] bytes for [out] with fallocate, so that the file is allocated in one piece and a full disk
+	/// is noticed before anything is written
+	/// </summary>
+	/// <returns>ENOSPC or EDQUOT if the file does not fit, otherwise 0</returns>
+	static int Preallocate(int out, uint64_t size);
+
+	/// <summary>
+	/// Copies from [in] to [out] starting at [offset] until the end of [in], advances [offset]
+	/// </summary>
+	/// <returns>0 on success, otherwise the errno of the first failing call</returns>
+	static int CopyFileRange(int in, int out, uint64_t& offset, Writeback& writeback);
+	static int SendFile(int in, int out, uint64_t& offset, Writeback& writeback);
+	/// <summary>
+	/// Copies through a buffer from the thread's BufferPool, sized for a file of [size] bytes
+	/// </summary>
+	static int ReadWrite(int in, int out, uint64_t& offset, uint64_t size, Writeback& writeback);
+	/// <summary>
+	/// Copies [length] bytes at [offset] with positional calls only, so that several threads can share the files
+	/// </summary>
+	int CopyRange(int in, int out, uint64_t offset, uint64_t length, bool& fallback, Writeback& writeback);
+	/// <summary>
+	/// Compares [length] bytes at [offset] of [in] and [out] and rewrites the blocks of [out] that differ, adds
+	/// the rewritten bytes to [written]. Positional calls only, like CopyRange.
+	/// </summary>
+	int UpdateRange(int in, int out, uint64_t offset, uint64_t length, uint64_t& written, Writeback& writeback);
+	/// <summary>
+	/// Returns whether [out] with [size] bytes looks like a prefix of [in], by comparing its first and its last
+	/// block with the same ranges of [in]
+	/// </summary>
+	static bool IsPrefix(int in, int out, uint64_t size);
+	/// <summary>
+	/// Copies the data ranges of [in] found with SEEK_DATA and SEEK_HOLE and leaves holes in between, [copied] is
+	/// set to the bytes in the data ranges
+	/// </summary>
+	int CopySparse(int in, int out, uint64_t size, uint64_t& copied, Writeback& writeback);
+	/// <summary>
+	/// Copies with O_DIRECT from [offset], which is advanced past the data that has been copied. Returns EINVAL if
+	/// the files do not support it, some filesystems only reject a read after the first ones, so the caller
+	/// continues from [offset] with a buffered copy.
+	/// </summary>
+	static int CopyDirect(int in, int out, uint64_t& offset, uint64_t size);
+	static int CopyDropBehind(int in, int out, uint64_t& offset, uint64_t size);
+#endif
+
+public:
+	/// <summary>
+	/// Copies [source] to [destination] and overwrites an existing file. The destination gets the permissions
+	/// and the modification time of the source.
+	/// Throws std::filesystem::filesystem_error on failure.
+	/// </summary>
+	/// <returns>the method that copied the last part of the file</returns>
+	Method Copy(const std::filesystem::path& source, const std::filesystem::path& destination);
+
+#ifdef __linux__
+	/// <summary>
+	/// Copies [sourceName] in the open directory [sourceDirectory] to [destinationName] in [destinationDirectory],
+	/// like Copy but without resolving full paths. Does not throw, so that the caller only has to build the full
+	/// paths for an error message.
+	/// </summary>
+	/// <returns>0 on success, otherwise the errno of the failed step described by [what]</returns>
+	int CopyAt(int sourceDirectory, const char* sourceName, int destinationDirectory, const char* destinationName, Method& method, const char*& what);
+#endif
+
+	/// <summary>
+	/// Opens [source] and [destination] and preallocates the destination for a copy with CopySplit.
+	/// Throws std::filesystem::filesystem_error on failure.
+	/// </summary>
+	std::shared_ptr<Split> OpenSplit(const std::filesystem::path& source, const std::filesystem::path& destination, uint64_t chunk = SplitChunkSize);
+
+	/// <summary>
+	/// Copies chunks of [split] until all of them have been claimed, may be called by any number of threads
+	/// </summary>
+	/// <returns>true for the one call that completed the last chunk, it has to call FinishSplit</returns>
+	bool CopySplit(Split& split);
+
+	/// <summary>
+	/// Sets the permissions and the modification time of the destination and closes both files.
+	/// Throws std::filesystem::filesystem_error if any part failed. A destination that has been updated in place
+	/// is kept with the oldest modification time then, any other one is removed.
+	/// </summary>
+	/// <returns>the method that has been used</returns>
+	Method FinishSplit(Split& split);
+
+	void SetReflink(Reflink reflink);
+
+	Reflink GetReflink();
+
+	/// <summary>
+	/// Copies files of at least [size] bytes past the page cache, with O_DIRECT where the filesystem supports it
+	/// and otherwise with a buffered copy that drops the pages behind itself
+	/// </summary>
+	void SetCacheNeutral(bool enabled, uint64_t size);
+
+	/// <summary>
+	/// Limits the dirty pages each copying thread leaves behind to about [bytes], by writing them back in a rolling
+	/// window behind the write cursor. 0 leaves the writeback to the kernel.
+	/// </summary>
+	void SetDirtyBudget(uint64_t bytes);
+
+	uint64_t GetDirtyBudget();
+
+	/// <summary>
+	/// Updates existing destinations of at least [size] bytes in place if they have the size of the source, only
+	/// the blocks that differ are written. Other destinations are copied as usual.
+	/// </summary>
+	void SetDelta(bool enabled, uint64_t size);
+
+	/// <summary>
+	/// Returns whether an existing destination of [size] bytes is updated in place
+	/// </summary>
+	bool IsDelta(uint64_t size);
+
+	/// <summary>
+	/// Only copies the new tail of sources that have grown behind an existing destination, like logs and journals.
+	/// A destination that is not a prefix of its source is copied as usual.
+	/// </summary>
+	void SetAppend(bool enabled);
+
+	bool IsAppend();
+
+	/// <summary>
+	/// Returns whether a file with [allocated] of [size] bytes on disk has enough holes for a sparse copy
+	/// </summary>
+	static bool IsSparse(uint64_t size, uint64_t allocated);
+
+	/// <summary>
+	/// Writes back the data of [files] and the directories that name them, so that they survive a crash. The
+	/// writeback of all files is started before the first one is waited for.
+	/// </summary>
+	/// <returns>an errno value for every file, 0 if it is durable</returns>
+	static std::vector<int> SyncFiles(const std::vector<std::filesystem::path>& files);
+
+	/// <summary>
+	/// Returns whether [first] and [second] have the same content
+	/// </summary>
+	static bool IsEqual(const std::filesystem::path& first, const std::filesystem::path& second);
+
+	/// <summary>
+	/// Returns whether a file of [size] bytes is copied past the page cache
+	/// </summary>
+	bool IsCacheNeutral(uint64_t size);
+
+	Statistics& GetStatistics(Method method);
+
+	void ResetStatistics();
+
+	static const char* GetName(Method method);
+
+	/// <summary>
+	/// Parses auto, always or never
+	/// </summary>
+	static bool ParseReflink(std::string_view text, Reflink& reflink);
+};
@@ -0,0 +1,49 @@
+#pragma once
+#include <cstddef>
+#include <list>
+#include <string>
+#include <utility>
+
+#include <boost/unordered_map.hpp>
+
+/// <summary>
+/// Keeps the most recently used directories open, so that files in them can be opened with openat and friends
+/// instead of resolving their full paths from the root every time. The least recently used directory is closed
+/// once [capacity] directories are open. Not thread-safe, every worker owns its own cache.
+/// Only caches descriptors on linux, Get always fails on other platforms.
+/// </summary>
+class DirectoryCache
+{
+private:
+	size_t _capacity = 1;
+	/// <summary>
+	/// most recently used first
+	/// </summary>
+	std::list<std::pair<std::wstring, int>> _entries;
+	boost::unordered_map<std::wstring, std::list<std::pair<std::wstring, int>>::iterator> _index;
+
+public:
+	explicit DirectoryCache(size_t capacity);
+	~DirectoryCache();
+
+	DirectoryCache(const DirectoryCache&) = delete;
+	DirectoryCache& operator=(const DirectoryCache&) = delete;
+
+	/// <summary>
+	/// Returns a descriptor for the directory [path], which stays valid until the next call
+	/// </summary>
+	/// <returns>-1 if the directory cannot be opened</returns>
+	int Get(const std::wstring& path);
+
+	/// <summary>
+	/// Closes all cached directories
+	/// </summary>
+	void Clear();
+
+	size_t Size();
+
+	/// <summary>
+	/// Splits the descriptors allowed by RLIMIT_NOFILE among [caches] caches, after keeping [reserved] for other uses
+	/// </summary>
+	static size_t GetCapacity(size_t caches, size_t reserved);
+};
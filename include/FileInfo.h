@@ -0,0 +1,32 @@
+#pragma once
+#include <cstdint>
+#include <string>
+
+/// <summary>
+/// Metadata of a directory entry, captured once while walking a tree
+/// </summary>
+struct FileInfo
+{
+	uint64_t size = 0;
+	/// <summary>
+	/// bytes allocated on disk, less than [size] for sparse files. Equal to [size] where it is not known.
+	/// </summary>
+	uint64_t allocated = 0;
+	/// <summary>
+	/// last write time in nanoseconds on linux, in ticks of std::filesystem::file_time_type elsewhere
+	/// </summary>
+	int64_t mtime = 0;
+	uint64_t inode = 0;
+	uint64_t device = 0;
+	uint32_t mode = 0;
+	/// <summary>
+	/// number of hard links to the file, 0 where it is not known
+	/// </summary>
+	uint32_t links = 0;
+};
+
+struct FileEntry
+{
+	std::wstring path;
+	FileInfo info;
+};
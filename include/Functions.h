@@ -1,8 +1,15 @@
 #pragma once
+#include "CopyEngine.h"
+#include "FileInfo.h"
+#include "MPMCQueue.h"
+#include "Manifest.h"
 #include "Types.h"
+#include "UringExecutor.h"
+#include "Walker.h"
 #include <string>
 #include <vector>
 #include <thread>
+#include <chrono>
 #include <filesystem>
 #include <unordered_set>
 #include <set>
@@ -10,65 +17,392 @@
 #include <mutex>
 #include <shared_mutex>
 
+#include <boost/unordered_map.hpp>
 #include <boost/unordered_set.hpp>
 
+/// <summary>
+/// Optional settings for Functions::Copy
+/// </summary>
+struct CopyOptions
+{
+	/// <summary>
+	/// manifest of the input tree. Unchanged directories are served from it and it is rewritten after the copy.
+	/// </summary>
+	std::filesystem::path manifest;
+	/// <summary>
+	/// manifest of the output tree. If it exists the output tree is not scanned, it is kept up to date with every
+	/// file that is copied or deleted and rewritten after the copy.
+	/// </summary>
+	std::filesystem::path destinationManifest;
+	/// <summary>
+	/// percentage of the files in the destination manifest that are checked against the output tree before it is trusted
+	/// </summary>
+	int verifyManifest = 0;
+	/// <summary>
+	/// whether files are cloned instead of copied where the filesystem supports it
+	/// </summary>
+	CopyEngine::Reflink reflink = CopyEngine::Reflink::Auto;
+
+	enum class Executor
+	{
+		/// <summary>
+		/// every worker copies one file at a time with blocking syscalls
+		/// </summary>
+		Threads,
+		/// <summary>
+		/// every worker keeps [uringDepth] files in flight with io_uring
+		/// </summary>
+		Uring,
+	};
+	Executor executor = Executor::Threads;
+	unsigned uringDepth = 128;
+
+	/// <summary>
+	/// copies files of at least [cacheNeutralSize] bytes past the page cache
+	/// </summary>
+	bool cacheNeutral = false;
+	uint64_t cacheNeutralSize = 64 * 1024 * 1024;
+
+	/// <summary>
+	/// updates existing output files of at least [deltaSize] bytes in place, only the blocks that changed are written
+	/// </summary>
+	bool delta = false;
+	uint64_t deltaSize = 64 * 1024 * 1024;
+
+	/// <summary>
+	/// only copies the new tail of files that have grown behind their copy in the output folder
+	/// </summary>
+	bool append = false;
+
+	/// <summary>
+	/// backs the copy buffers of big files with 2 MiB huge pages
+	/// </summary>
+	bool hugePages = false;
+
+	/// <summary>
+	/// dirty bytes each worker may leave in the page cache before it writes them back, 0 leaves it to the kernel
+	/// </summary>
+	uint64_t dirtyBudget = 0;
+
+	/// <summary>
+	/// checks that the files fit into the free space of the output before anything is copied, the copy only
+	/// starts after the scan in that case
+	/// </summary>
+	bool checkSpace = false;
+
+	/// <summary>
+	/// with deletewithoutmatch, output files without a match are renamed to new input files with the same size and
+	/// modification time instead of copying the new and deleting the old file. The copy only starts after the scan
+	/// in that case.
+	/// </summary>
+	bool detectRenames = false;
+	/// <summary>
+	/// compares the content before a detected rename, and also resolves ambiguous matches that way
+	/// </summary>
+	bool verifyRenames = false;
+
+	/// <summary>
+	/// compares files moved to another filesystem with their source before the source is removed
+	/// </summary>
+	bool verifyMoves = false;
+};
+
 class Functions
 {
 private:
-	ts_deque<std::wstring> _copyQueue;
-	ts_deque<std::wstring> _deleteQueue;
-	ts_deque<std::wstring> _createDirsQueue;
-	bool _doneCreatingDirs = false;
-	bool _doneStuff = false;
-	std::condition_variable _waiterCond;
-	std::mutex _waiter;
-	std::wstring _inputPrefix;
-	std::wstring _outputPrefix;
+	/// <summary>
+	/// maximum number of directory batches waiting for a worker, the scan blocks while the workers catch up
+	/// </summary>
+	static constexpr size_t QueueCapacity = 4096;
+	/// <summary>
+	/// batches with more jobs are split when a worker takes them, so that idle workers can steal parts of big directories
+	/// </summary>
+	static constexpr size_t SplitSize = 256;
+	/// <summary>
+	/// files of at least this size are copied in chunks by all workers that are idle
+	/// </summary>
+	static constexpr uint64_t LargeFileSize = 4 * CopyEngine::SplitChunkSize;
+	/// <summary>
+	/// maximum number of files moved to another filesystem whose source has not been removed yet, the workers
+	/// wait while the removal catches up
+	/// </summary>
+	static constexpr size_t RetireCapacity = 4096;
+	/// <summary>
+	/// files whose copies are written back together before their sources are removed
+	/// </summary>
+	static constexpr size_t RetireBatch = 256;
 
-	std::vector<std::thread> _threads;
+	/// <summary>
+	/// Single file operation executed by the workers
+	/// </summary>
+	struct Job
+	{
+		enum class Action
+		{
+			Copy,
+			Delete,
+			/// <summary>
+			/// helps copying the chunks of [split]
+			/// </summary>
+			Part,
+		};
 
-	ts_deque<std::wstring> IFilesSet;
-	boost::unordered_set<std::wstring> IDirSet;
-	boost::unordered_set<std::wstring> OFilesSet;
-	boost::unordered_set<std::wstring> ODirSet;
+		Action action = Action::Copy;
+		/// <summary>
+		/// path relative to the input and output folder
+		/// </summary>
+		FileEntry file;
+		std::shared_ptr<CopyEngine::Split> split;
+		/// <summary>
+		/// size of the output file that is overwritten, 0 if there is none
+		/// </summary>
+		uint64_t existing = 0;
+		/// <summary>
+		/// names of the output file that is overwritten, it is replaced instead if it has more than one
+		/// </summary>
+		uint32_t existingLinks = 0;
+	};
 
-	std::deque<std::wstring> filesinput;
-	std::deque<std::wstring> dirsinput;
-	std::deque<std::wstring> filesoutput;
-	std::deque<std::wstring> dirsoutput;
+	/// <summary>
+	/// Jobs of a single directory, they are always handled together by one worker
+	/// </summary>
+	struct Batch
+	{
+		/// <summary>
+		/// directory relative to the input and output folder
+		/// </summary>
+		std::wstring directory;
+		std::vector<Job> jobs;
+	};
 
-	std::deque<std::wstring> dirstmp;
+	/// <summary>
+	/// Further name of a hard linked input file, it is linked to the copy of [target] once all files are copied
+	/// </summary>
+	struct HardLink
+	{
+		FileEntry file;
+		std::wstring target;
+	};
+
+	struct WorkerDeque
+	{
+		std::mutex lock;
+		std::deque<Batch> batches;
+	};
+
+	/// <summary>
+	/// filled by the scan and closed once it is finished. Workers move batches from here into their own deque and
+	/// steal from the other workers' deques once it is empty.
+	/// </summary>
+	MPMCQueue<Batch> _batches{ QueueCapacity };
+	/// <summary>
+	/// files that have been copied to another filesystem in move mode, their sources are removed by _retirer
+	/// </summary>
+	MPMCQueue<Job> _retire{ RetireCapacity };
+	std::thread _retirer;
+	std::atomic<size_t> _retiredFiles = 0;
+	std::atomic<uint64_t> _retiredBytes = 0;
+	std::vector<WorkerDeque> _workerDeques;
+	CopyEngine _engine;
+	std::atomic<uint64_t> _uringBytes = 0;
+	std::atomic<size_t> _batchCount = 0;
+	std::atomic<size_t> _stolenCount = 0;
+	/// <summary>
+	/// big files that are being copied, idle workers join them
+	/// </summary>
+	std::vector<Job> _splits;
+	std::mutex _splitsLock;
+	/// <summary>
+	/// number of workers that have run out of work, they wait for _idleEpoch to change
+	/// </summary>
+	std::atomic<int> _idle = 0;
+	std::atomic<size_t> _splitCount = 0;
+	/// <summary>
+	/// batches of the scan that are held back until the space check has passed
+	/// </summary>
+	std::vector<Batch> _held;
+	std::mutex _heldLock;
+	bool _holdBatches = false;
+	/// <summary>
+	/// bytes allocated by the output files that are overwritten by the queued copies
+	/// </summary>
+	std::atomic<uint64_t> _bytesReplaced = 0;
+	/// <summary>
+	/// first name of every input file with several hard links, by device and inode
+	/// </summary>
+	boost::unordered_map<std::pair<uint64_t, uint64_t>, std::wstring> _inodes;
+	std::vector<HardLink> _links;
+	std::mutex _linksLock;
+	size_t _linkCount = 0;
+	size_t _renameCount = 0;
+	std::atomic<size_t> _movedDirectories = 0;
+	uint64_t _renameBytes = 0;
+	/// <summary>
+	/// directories each worker keeps open, bounded by RLIMIT_NOFILE
+	/// </summary>
+	size_t _directoryCacheSize = 2;
+	std::atomic<uint32_t> _idleEpoch = 0;
+	std::wstring _inputPrefix;
+	std::wstring _outputPrefix;
 
-	std::shared_mutex barrier;
+	std::vector<std::thread> _threads;
 
-	int outputprefixlength = 0;
-	int inputprefixlength = 0;
+	/// <summary>
+	/// directories that only exist in the output, removed after all files have been handled
+	/// </summary>
+	boost::unordered_set<std::wstring> ODirSet;
+	std::mutex _odirsLock;
+	/// <summary>
+	/// directories created by the scan that have not been compared yet. Neither they nor their subdirectories
+	/// have anything in the output, so their files are copied without looking at the output.
+	/// </summary>
+	boost::unordered_set<std::wstring> _freshDirectories;
+	std::mutex _freshLock;
+	std::atomic<size_t> _freshCount = 0;
 
-	int cdeleted = 0;
+	std::atomic<int> cdeleted = 0;
 	
 	bool _move = false;
 	bool _force = false;
 	bool _overwriteexisting = false;
+	bool _deletewithoutmatch = false;
+
+	/// <summary>
+	/// state of the output tree, only maintained if a destination manifest is used
+	/// </summary>
+	TreeState _destination;
+	bool _trackDestination = false;
+	/// <summary>
+	/// whether _destination is used instead of reading the output directories
+	/// </summary>
+	bool _trustDestination = false;
+
+	/// <summary>
+	/// Checks [percent] percent of the files in _destination against the output tree
+	/// </summary>
+	/// <returns>whether all checked files match</returns>
+	bool Helper_VerifyDestination(int percent);
+
+	/// <summary>
+	/// Compares the bytes the scan has queued for copying with the free space of [outputPath]
+	/// </summary>
+	/// <returns>false if they do not fit</returns>
+	bool Helper_CheckSpace(const std::filesystem::path& outputPath);
 
-	void Helper_IFiles();
-	void Helper_OFiles();
-	void Helper_IDirSet();
-	void Helper_ODirSet();
+	/// <summary>
+	/// Compares the input directory [relative] with its output counterpart, creates missing subdirectories and
+	/// queues the resulting copy and delete jobs. When moving, subdirectories that are missing in the output are
+	/// renamed as a whole and skipped by the [walker].
+	/// </summary>
+	void Helper_DiffDirectory(Walker& walker, int worker, const std::wstring& relative, const DirListing& input);
+
+	/// <summary>
+	/// Moves the input directory [dir] with all of its content to the output with a single rename
+	/// </summary>
+	/// <returns>false if that is not possible, e.g. because the output is on another filesystem</returns>
+	bool Helper_MoveDirectory(const std::wstring& dir);
 
-	void Helper_SortFiles();
+	/// <summary>
+	/// Takes the next batch for [worker]: its own newest batch first, then a new batch from the scan, then the
+	/// oldest batch of another worker
+	/// </summary>
+	/// <returns>false once the scan is finished and no work is left, or if nothing is available and [wait] is not set</returns>
+	bool Helper_NextBatch(int worker, Batch& batch, bool wait = true);
 
-	void Helper_CreateDirs();
+	bool Helper_StealBatch(int worker, Batch& batch);
 
-	void DoStuff();
+	/// <summary>
+	/// Waits until a batch can be stolen or a big file can be shared, as long as any other worker is still busy
+	/// </summary>
+	/// <returns>false once all workers are out of work</returns>
+	bool Helper_WaitForWork(int worker, Batch& batch);
+
+	/// <summary>
+	/// Takes a part job for a big file that still has unclaimed chunks
+	/// </summary>
+	bool Helper_JoinSplit(Batch& batch);
+
+	/// <summary>
+	/// Wakes the idle workers after new work has been made available
+	/// </summary>
+	void Helper_Wake();
+
+	bool Helper_IsLarge(const Job& job);
+	/// <summary>
+	/// Returns whether the output file of [job] may be a prefix of the input file that only needs its tail
+	/// </summary>
+	bool Helper_IsAppend(const Job& job);
+
+	/// <summary>
+	/// Starts the chunked copy of a big file and offers it to the other workers
+	/// </summary>
+	void Helper_SplitFile(const Job& job);
+
+	/// <summary>
+	/// Copies chunks of a split file, the worker that completes the last one finishes the file
+	/// </summary>
+	void Helper_CopyPart(const Job& part);
+
+	/// <summary>
+	/// Executes [job] with blocking calls. If the descriptors of the job's input and output directory are given,
+	/// the file is addressed relative to them.
+	/// </summary>
+	void Helper_RunJob(const Job& job, int inputDirectory = -1, int outputDirectory = -1);
+
+#ifdef __linux__
+	void Helper_RunJobAt(const Job& job, int inputDirectory, int outputDirectory);
+#endif
+
+	/// <summary>
+	/// Updates the statistics and the destination state after [job] has been copied, the copy is stat'ed relative
+	/// to [outputDirectory] if it is given
+	/// </summary>
+	void Helper_Copied(const Job& job, int outputDirectory = -1, const char* name = nullptr);
+
+	/// <summary>
+	/// Matches the new files of the held batches with the output files that are about to be deleted, including
+	/// those in output-only directories, and renames the matches in the output folder. The matched copy and delete
+	/// jobs are removed from the batches.
+	/// </summary>
+	void Helper_DetectRenames(bool verify, int processors);
+
+	/// <summary>
+	/// Creates the hard links collected by the scan. A name whose target is not an up to date copy is copied
+	/// on its own instead.
+	/// </summary>
+	void Helper_LinkFiles();
+
+	void DoStuff(int worker);
+
+	/// <summary>
+	/// Removes the sources of files that have been moved to another filesystem. The copies are verified if
+	/// [verify] is set and made durable, a group of files at a time, before their sources are removed.
+	/// </summary>
+	void DoRetire(bool verify);
+
+	/// <summary>
+	/// Worker that copies files with an io_uring executor, deletes, moves, big files, cache-neutral, delta and
+	/// append copies are still blocking
+	/// </summary>
+	void DoStuffUring(int worker, unsigned depth);
 
 	bool _finished = false;
 
 public:
-	static void GetFiles(std::filesystem::path inputPath, std::deque<std::wstring>& outfiles, std::deque<std::wstring>& outdirs);
-	static boost::unordered_set<std::wstring> GetFilesRelative(std::filesystem::path inputPath);
-	static void GetFilesRelative(std::filesystem::path inputPath, boost::unordered_set<std::wstring>& files, boost::unordered_set<std::wstring>& dirs);
+	/// <summary>
+	/// Recursively collects all files and directories in [inputPath], using [threads] workers
+	/// </summary>
+	/// <returns>number of visited entries</returns>
+	static size_t GetFiles(std::filesystem::path inputPath, std::deque<std::wstring>& outfiles, std::deque<std::wstring>& outdirs, int threads = 1);
+	/// <summary>
+	/// Recursively collects all files with their metadata and all directories in [inputPath], using [threads] workers
+	/// </summary>
+	/// <returns>number of visited entries</returns>
+	static size_t GetFiles(std::filesystem::path inputPath, std::deque<FileEntry>& outfiles, std::deque<std::wstring>& outdirs, int threads = 1);
+	static boost::unordered_set<std::wstring> GetFilesRelative(std::filesystem::path inputPath, int threads = 1);
+	static void GetFilesRelative(std::filesystem::path inputPath, boost::unordered_set<std::wstring>& files, boost::unordered_set<std::wstring>& dirs, int threads = 1);
 
-	void Copy(std::filesystem::path inputPath, std::filesystem::path outputPath, bool deletewithoutmatch, bool overwriteexisting, bool force, bool move, int processors);
+	void Copy(std::filesystem::path inputPath, std::filesystem::path outputPath, bool deletewithoutmatch, bool overwriteexisting, bool force, bool move, int processors, const CopyOptions& options = {});
 
 	void ReconstitueSymlinks(std::vector<std::filesystem::path> folders);
 
@@ -81,7 +415,21 @@ public:
 	std::atomic<size_t> _bytesToCopy = 0;
 	std::atomic<size_t> _filesToCopy = 0;
 	std::atomic<size_t> _bytesCopied = 0;
+	/// <summary>
+	/// part of _bytesCopied that has been cloned instead of copied
+	/// </summary>
+	std::atomic<size_t> _bytesCloned = 0;
 	std::atomic<size_t> _filesCopied = 0;
+	/// <summary>
+	/// like _bytesToCopy and _bytesCopied, but without the holes of sparse files
+	/// </summary>
+	std::atomic<size_t> _physicalBytesToCopy = 0;
+	std::atomic<size_t> _physicalBytesCopied = 0;
+
+	/// <summary>
+	/// free space of the output that the space check takes instead of asking the filesystem, unless it is 0
+	/// </summary>
+	uint64_t _assumedSpace = 0;
 
 	bool _activeCopy = false;
 
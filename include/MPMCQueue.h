@@ -0,0 +1,197 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+/// <summary>
+/// Bounded lock-free multi-producer multi-consumer queue.
+/// Every cell carries a sequence number that tells producers and consumers whether it is free or filled for their
+/// position, so a push or pop only needs a single compare-and-swap on the shared index. Blocking callers sleep on
+/// an atomic counter (a futex on linux) and are only woken if somebody actually waits.
+/// After Close() pushes fail and pops drain the remaining items before they fail as well.
+/// </summary>
+template <class T>
+class MPMCQueue
+{
+private:
+	static constexpr size_t CacheLine = 64;
+
+	struct Cell
+	{
+		std::atomic<size_t> sequence;
+		T value;
+	};
+
+	std::unique_ptr<Cell[]> _cells;
+	size_t _mask = 0;
+
+	alignas(CacheLine) std::atomic<size_t> _enqueue = 0;
+	alignas(CacheLine) std::atomic<size_t> _dequeue = 0;
+
+	/// <summary>
+	/// incremented after every push and pop, blocked consumers and producers wait for them to change
+	/// </summary>
+	alignas(CacheLine) std::atomic<uint32_t> _pushed = 0;
+	std::atomic<uint32_t> _consumers = 0;
+	alignas(CacheLine) std::atomic<uint32_t> _popped = 0;
+	std::atomic<uint32_t> _producers = 0;
+
+	std::atomic<bool> _closed = false;
+
+public:
+	/// <summary>
+	/// Creates a queue that holds at least [capacity] items, the capacity is rounded up to a power of two
+	/// </summary>
+	explicit MPMCQueue(size_t capacity)
+	{
+		size_t size = 2;
+		while (size < capacity)
+			size <<= 1;
+		_cells = std::make_unique<Cell[]>(size);
+		_mask = size - 1;
+		for (size_t i = 0; i < size; i++)
+			_cells[i].sequence.store(i, std::memory_order_relaxed);
+	}
+
+	MPMCQueue(const MPMCQueue&) = delete;
+	MPMCQueue& operator=(const MPMCQueue&) = delete;
+
+	/// <summary>
+	/// Appends [value] if the queue is neither full nor closed. [value] is only moved from on success.
+	/// </summary>
+	bool TryPush(T&& value)
+	{
+		if (_closed.load(std::memory_order_relaxed))
+			return false;
+		Cell* cell;
+		size_t pos = _enqueue.load(std::memory_order_relaxed);
+		while (true) {
+			cell = &_cells[pos & _mask];
+			size_t sequence = cell->sequence.load(std::memory_order_acquire);
+			intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+			if (diff == 0) {
+				if (_enqueue.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			} else if (diff < 0)
+				return false;
+			else
+				pos = _enqueue.load(std::memory_order_relaxed);
+		}
+		cell->value = std::move(value);
+		cell->sequence.store(pos + 1, std::memory_order_release);
+		_pushed.fetch_add(1, std::memory_order_seq_cst);
+		if (_consumers.load(std::memory_order_seq_cst) > 0)
+			_pushed.notify_one();
+		return true;
+	}
+
+	/// <summary>
+	/// Takes the oldest item if the queue is not empty
+	/// </summary>
+	bool TryPop(T& value)
+	{
+		Cell* cell;
+		size_t pos = _dequeue.load(std::memory_order_relaxed);
+		while (true) {
+			cell = &_cells[pos & _mask];
+			size_t sequence = cell->sequence.load(std::memory_order_acquire);
+			intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+			if (diff == 0) {
+				if (_dequeue.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			} else if (diff < 0)
+				return false;
+			else
+				pos = _dequeue.load(std::memory_order_relaxed);
+		}
+		value = std::move(cell->value);
+		cell->sequence.store(pos + _mask + 1, std::memory_order_release);
+		_popped.fetch_add(1, std::memory_order_seq_cst);
+		if (_producers.load(std::memory_order_seq_cst) > 0)
+			_popped.notify_one();
+		return true;
+	}
+
+	/// <summary>
+	/// Appends [value], waits while the queue is full
+	/// </summary>
+	/// <returns>false if the queue has been closed</returns>
+	bool Push(T&& value)
+	{
+		while (true) {
+			uint32_t ticket = _popped.load(std::memory_order_seq_cst);
+			if (TryPush(std::move(value)))
+				return true;
+			if (_closed.load(std::memory_order_seq_cst))
+				return false;
+			_producers.fetch_add(1, std::memory_order_seq_cst);
+			_popped.wait(ticket, std::memory_order_seq_cst);
+			_producers.fetch_sub(1, std::memory_order_seq_cst);
+		}
+	}
+
+	/// <summary>
+	/// Takes the oldest item, waits while the queue is empty
+	/// </summary>
+	/// <returns>false once the queue has been closed and is empty</returns>
+	bool Pop(T& value)
+	{
+		while (true) {
+			uint32_t ticket = _pushed.load(std::memory_order_seq_cst);
+			if (TryPop(value))
+				return true;
+			if (_closed.load(std::memory_order_seq_cst))
+				return TryPop(value);
+			_consumers.fetch_add(1, std::memory_order_seq_cst);
+			_pushed.wait(ticket, std::memory_order_seq_cst);
+			_consumers.fetch_sub(1, std::memory_order_seq_cst);
+		}
+	}
+
+	/// <summary>
+	/// Rejects all further pushes and wakes every waiting thread
+	/// </summary>
+	void Close()
+	{
+		_closed.store(true, std::memory_order_seq_cst);
+		_pushed.fetch_add(1, std::memory_order_seq_cst);
+		_pushed.notify_all();
+		_popped.fetch_add(1, std::memory_order_seq_cst);
+		_popped.notify_all();
+	}
+
+	/// <summary>
+	/// Accepts pushes again after Close(), must not be called while other threads use the queue
+	/// </summary>
+	void Reopen()
+	{
+		_closed.store(false, std::memory_order_seq_cst);
+	}
+
+	bool IsClosed()
+	{
+		return _closed.load(std::memory_order_relaxed);
+	}
+
+	/// <summary>
+	/// Returns the number of items in the queue, only exact while no other thread uses it
+	/// </summary>
+	size_t Size()
+	{
+		size_t dequeue = _dequeue.load(std::memory_order_relaxed);
+		size_t enqueue = _enqueue.load(std::memory_order_relaxed);
+		return enqueue > dequeue ? enqueue - dequeue : 0;
+	}
+
+	bool Empty()
+	{
+		return Size() == 0;
+	}
+
+	size_t Capacity()
+	{
+		return _mask + 1;
+	}
+};
@@ -0,0 +1,230 @@
+#pragma once
+#include "FileInfo.h"
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <boost/unordered_map.hpp>
+#include <boost/unordered_set.hpp>
+
+/// <summary>
+/// Listing of a single directory as it is stored in a manifest.
+/// Names are the native byte strings on linux and utf-8 elsewhere, paths are relative to the root of the walk.
+/// </summary>
+struct DirListing
+{
+	std::string path;
+	int64_t mtime = 0;
+	std::vector<std::pair<std::string, FileInfo>> files;
+	std::vector<std::string> dirs;
+};
+
+/// <summary>
+/// Persistent binary snapshot of a directory tree.
+/// The file is memory mapped and accessed in place: fixed size directory and file records that are indexed by
+/// offset, and front-coded string tables with a restart point every [RestartInterval] strings.
+/// Directory paths are sorted, so a directory is found with a binary search over the restart points.
+/// </summary>
+class Manifest
+{
+public:
+	static constexpr uint32_t Magic = 0x464D4653;  // "SFMF"
+	static constexpr uint32_t Version = 2;
+	static constexpr uint64_t RestartInterval = 16;
+
+	struct StringTable
+	{
+		uint64_t count;
+		uint64_t restartOffset;
+		uint64_t dataOffset;
+		uint64_t dataSize;
+	};
+
+	struct Header
+	{
+		uint32_t magic;
+		uint32_t version;
+		/// <summary>
+		/// time the tree was scanned, in the same unit as FileInfo::mtime
+		/// </summary>
+		int64_t created;
+		uint64_t dirCount;
+		uint64_t fileCount;
+		uint64_t childCount;
+		uint64_t dirOffset;
+		uint64_t fileOffset;
+		StringTable dirPaths;
+		StringTable fileNames;
+		StringTable childNames;
+	};
+
+	struct DirRecord
+	{
+		int64_t mtime;
+		uint64_t firstFile;
+		uint64_t firstChild;
+		uint32_t fileCount;
+		uint32_t childCount;
+	};
+
+	struct FileRecord
+	{
+		uint64_t size;
+		uint64_t allocated;
+		int64_t mtime;
+		uint64_t inode;
+		uint64_t device;
+		uint32_t mode;
+		uint32_t links;
+	};
+
+private:
+	const uint8_t* _data = nullptr;
+	size_t _size = 0;
+	const Header* _header = nullptr;
+#ifdef _WIN32
+	void* _file = nullptr;
+	void* _mapping = nullptr;
+#endif
+
+	std::string GetString(const StringTable& table, uint64_t index) const;
+	bool FindDirectory(std::string_view path, uint64_t& index) const;
+	bool Validate() const;
+
+public:
+	Manifest() = default;
+	Manifest(const Manifest&) = delete;
+	Manifest& operator=(const Manifest&) = delete;
+	~Manifest();
+
+	/// <summary>
+	/// Maps [file] into memory. Returns false and stays empty if the file is missing or not a valid manifest.
+	/// </summary>
+	bool Load(const std::filesystem::path& file);
+
+	void Unload();
+
+	bool IsLoaded() const;
+
+	size_t GetDirectoryCount() const;
+
+	size_t GetFileCount() const;
+
+	/// <summary>
+	/// Fills [listing] with the cached listing of the directory [path], if the directory is known with the
+	/// modification time [mtime] and has not been modified shortly before the manifest was created
+	/// </summary>
+	bool GetListing(std::string_view path, int64_t mtime, DirListing& listing) const;
+
+	/// <summary>
+	/// Calls [func] with every directory listing that is stored in the manifest
+	/// </summary>
+	template <class Func>
+	void ForEach(Func func) const
+	{
+		if (!IsLoaded())
+			return;
+		DirListing listing;
+		for (uint64_t i = 0; i < _header->dirCount; i++) {
+			Read(i, listing);
+			func(listing);
+		}
+	}
+
+	/// <summary>
+	/// Reads the directory with the index [index]
+	/// </summary>
+	void Read(uint64_t index, DirListing& listing) const;
+
+	/// <summary>
+	/// Writes [listings] into [file]. The manifest is written to a temporary file first and then renamed.
+	/// [listings] is sorted in place.
+	/// </summary>
+	static bool Write(const std::filesystem::path& file, std::vector<DirListing>& listings, int64_t created);
+
+	/// <summary>
+	/// Returns the current time in the unit of FileInfo::mtime
+	/// </summary>
+	static int64_t Now();
+
+	/// <summary>
+	/// Converts a wide path into the encoding used for manifest names
+	/// </summary>
+	static std::string Encode(std::wstring_view path);
+
+	/// <summary>
+	/// Converts a manifest name into a wide string
+	/// </summary>
+	static std::wstring Decode(std::string_view name);
+};
+
+/// <summary>
+/// Mutable in-memory version of a manifest. Tracks the state of a tree while it is modified and can be
+/// written back as a manifest. All paths use the manifest encoding and are relative to the root of the tree.
+/// </summary>
+class TreeState
+{
+private:
+	struct Directory
+	{
+		int64_t mtime = 0;
+		boost::unordered_map<std::string, FileInfo> files;
+		boost::unordered_set<std::string> dirs;
+	};
+
+	std::mutex _lock;
+	boost::unordered_map<std::string, Directory> _dirs;
+
+	Directory& GetDirectory(const std::string& path);
+	void EraseDirectoryRecursive(const std::string& path);
+
+public:
+	/// <summary>
+	/// Replaces the state with the content of [manifest]
+	/// </summary>
+	void Load(const Manifest& manifest);
+
+	/// <summary>
+	/// Adds the directory listings of a walk
+	/// </summary>
+	void Add(std::vector<DirListing>& listings);
+
+	/// <summary>
+	/// Adds a single directory listing
+	/// </summary>
+	void Add(const DirListing& listing);
+
+	void Clear();
+
+	size_t GetDirectoryCount();
+
+	/// <summary>
+	/// Fills [listing] with the state of the directory [path]
+	/// </summary>
+	bool GetListing(const std::string& path, DirListing& listing);
+
+	/// <summary>
+	/// Adds or updates the file [path]
+	/// </summary>
+	void SetFile(const std::string& path, const FileInfo& info);
+
+	void EraseFile(const std::string& path);
+
+	/// <summary>
+	/// Adds the directory [path] and all missing parents
+	/// </summary>
+	void AddDirectory(const std::string& path);
+
+	/// <summary>
+	/// Removes the directory [path] with all of its content
+	/// </summary>
+	void EraseDirectory(const std::string& path);
+
+	/// <summary>
+	/// Returns the state as directory listings that can be written to a manifest
+	/// </summary>
+	std::vector<DirListing> GetListings();
+};
@@ -128,11 +128,6 @@ private:
 	}
 
 public:
-	~ts_deque()
-	{
-		_queue.~deque();
-	}
-
 	std::deque<T, Allocator>& data()
 	{
 		return _queue;
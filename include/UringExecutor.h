@@ -0,0 +1,88 @@
+#pragma once
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+/// <summary>
+/// Copies many files concurrently from a single thread with io_uring.
+/// Every file runs through a small state machine: the source is opened and statx'ed while the destination is
+/// created, the data is moved in chunks with a read that is linked to the matching write, and both files are
+/// closed at the end. Up to [depth] files are in flight at once, so a few threads keep hundreds of operations
+/// queued in the kernel. The ring is set up with raw syscalls, no liburing is needed.
+/// Only available on linux, Init() fails everywhere else.
+/// </summary>
+class UringExecutor
+{
+public:
+	/// <summary>
+	/// bytes moved per linked read and write
+	/// </summary>
+	static constexpr size_t ChunkSize = 256 * 1024;
+
+	/// <summary>
+	/// Called once a file is finished, [error] is an errno value or 0
+	/// </summary>
+	using Completion = std::function<void(uint64_t tag, int error, uint64_t bytes)>;
+
+private:
+	struct File;
+	struct Ring;
+
+	unsigned _depth = 0;
+	std::unique_ptr<Ring> _ring;
+	std::vector<File> _files;
+	std::vector<unsigned> _free;
+	std::unique_ptr<char[]> _buffers;
+	Completion _completion;
+
+#ifdef __linux__
+	void Prepare(File& file, unsigned index, uint8_t op, uint8_t flags);
+	void Open(File& file, unsigned index);
+	void Transfer(File& file, unsigned index);
+	void Rewrite(File& file, unsigned index);
+	void Close(File& file, unsigned index);
+	void Handle(unsigned index, uint8_t op, int32_t result);
+	void Abort(int error);
+#endif
+
+public:
+	UringExecutor(unsigned depth, Completion completion);
+	~UringExecutor();
+
+	UringExecutor(const UringExecutor&) = delete;
+	UringExecutor& operator=(const UringExecutor&) = delete;
+
+	/// <summary>
+	/// Returns whether the kernel allows creating a ring
+	/// </summary>
+	static bool IsSupported();
+
+	/// <summary>
+	/// Creates the ring, returns false if io_uring is not available
+	/// </summary>
+	bool Init();
+
+	/// <summary>
+	/// Queues the copy of [source] to [destination]. The destination gets the permissions and modification time
+	/// of the source. Must only be called while Full() is false.
+	/// </summary>
+	void Submit(const std::filesystem::path& source, const std::filesystem::path& destination, uint64_t tag);
+
+	/// <summary>
+	/// Submits all queued operations and handles the completions. If [wait] is set it blocks until at least one
+	/// operation has completed.
+	/// </summary>
+	/// <returns>false if the kernel rejected the ring, every file in flight has then failed with its error and
+	/// the executor must not be used anymore</returns>
+	bool Run(bool wait);
+
+	bool Full();
+
+	/// <summary>
+	/// Returns the number of files that are in flight
+	/// </summary>
+	size_t InFlight();
+};
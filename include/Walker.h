@@ -0,0 +1,181 @@
+#pragma once
+#include "FileInfo.h"
+#include "Manifest.h"
+#include <atomic>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/// <summary>
+/// Multi-threaded directory walker. Every directory is a task that is pushed onto the deque of the worker
+/// that found it. Workers take their own tasks from the back and steal from the front of other workers' deques.
+/// On linux directories are read with getdents64 and the entry type is taken from d_type, other platforms use
+/// std::filesystem::directory_iterator. If metadata is requested every entry is stat'ed exactly once.
+/// Directories whose modification time matches the one stored in the cache manifest are not read again, the
+/// cached listing is used instead.
+/// </summary>
+class Walker
+{
+public:
+	/// <summary>
+	/// Called once for every directory of a walk with its path relative to the root and its complete listing.
+	/// The subdirectories are queued after the call returns, so the visitor of a directory always runs before
+	/// the visitors of its children.
+	/// </summary>
+	using Visitor = std::function<void(int worker, const std::wstring& relative, const DirListing& listing)>;
+
+private:
+	struct Task
+	{
+		/// <summary>
+		/// native path used for the syscalls
+		/// </summary>
+		std::filesystem::path path;
+		/// <summary>
+		/// path relative to the root of the walk
+		/// </summary>
+		std::wstring relative;
+	};
+
+	struct WorkDeque
+	{
+		std::mutex lock;
+		std::deque<Task> tasks;
+	};
+
+	struct Result
+	{
+		std::vector<FileEntry> files;
+		std::vector<std::wstring> dirs;
+		std::vector<char> buffer;
+		std::vector<DirListing> listings;
+		DirListing cached;
+		DirListing current;
+		/// <summary>
+		/// subdirectories of the directory that is being visited which are not walked
+		/// </summary>
+		std::vector<std::string> skipped;
+	};
+
+	int _threads = 1;
+	bool _relative = false;
+	bool _metadata = false;
+	bool _record = false;
+	std::wstring _prefix;
+	size_t _rootLength = 0;
+	const Manifest* _cache = nullptr;
+	const Visitor* _visitor = nullptr;
+
+	std::vector<WorkDeque> _deques;
+	std::vector<Result> _results;
+
+	/// <summary>
+	/// number of directories that have been queued but not yet been fully listed
+	/// </summary>
+	std::atomic<size_t> _pending = 0;
+	/// <summary>
+	/// incremented after every push and once the last directory is done, idle threads wait for it to change
+	/// </summary>
+	std::atomic<uint32_t> _pushed = 0;
+	std::atomic<uint32_t> _idle = 0;
+	std::atomic<size_t> _entries = 0;
+	std::atomic<size_t> _reused = 0;
+
+	void Push(int worker, Task task);
+	bool Pop(int worker, Task& task);
+	bool Steal(int worker, Task& task);
+
+	void AddEntry(int worker, const Task& parent, std::filesystem::path path, std::wstring name, bool directory, const FileInfo& info);
+
+#ifdef __linux__
+	void VisitEntry(int worker, const Task& task, int fd, std::string& path, size_t dirlength, const char* name, unsigned char type, const FileInfo* cached, DirListing* listing);
+#endif
+
+	void ListDirectory(int worker, const Task& task);
+
+	/// <summary>
+	/// Passes the listing of [task] to the visitor and queues its subdirectories
+	/// </summary>
+	void VisitDirectory(int worker, const Task& task, const DirListing& listing);
+
+	void Run(int worker);
+
+	void Walk(const std::filesystem::path& root, bool relative, bool metadata);
+
+public:
+	/// <summary>
+	/// size of the buffer each worker passes to getdents64
+	/// </summary>
+	static constexpr size_t BufferSize = 512 * 1024;
+
+	Walker(int threads);
+
+	/// <summary>
+	/// Reads the metadata of a single file, in the same representation the walker uses
+	/// </summary>
+	static bool Stat(const std::filesystem::path& path, FileInfo& info);
+
+#ifdef __linux__
+	/// <summary>
+	/// Reads the metadata of the file [name] in the open directory [directory]
+	/// </summary>
+	static bool StatAt(int directory, const char* name, FileInfo& info);
+#endif
+
+	/// <summary>
+	/// Reads the entries of the single directory [path] with their metadata into [listing]
+	/// </summary>
+	/// <returns>false if the directory cannot be opened</returns>
+	static bool ReadDirectory(const std::filesystem::path& path, DirListing& listing);
+
+	/// <summary>
+	/// Sets a manifest of a previous walk over the same root, used to skip reading unchanged directories
+	/// </summary>
+	void SetCache(const Manifest* cache);
+
+	/// <summary>
+	/// Enables recording the listing of every directory, so that they can be written to a manifest
+	/// </summary>
+	void RecordListings(bool record);
+
+	/// <summary>
+	/// Returns the recorded directory listings of the last walk
+	/// </summary>
+	std::vector<DirListing> TakeListings();
+
+	/// <summary>
+	/// Returns the number of directories that were taken from the cache manifest in the last walk
+	/// </summary>
+	size_t GetReusedDirectories();
+
+	/// <summary>
+	/// Recursively lists [root] and appends all files and directories to the output lists.
+	/// If [relative] is set the paths are relative to [root], otherwise they start with [root].
+	/// </summary>
+	/// <returns>number of entries that have been visited</returns>
+	size_t Walk(const std::filesystem::path& root, std::deque<std::wstring>& outfiles, std::deque<std::wstring>& outdirs, bool relative = false);
+
+	/// <summary>
+	/// Recursively lists [root] and appends all files, together with their metadata, and directories to the output lists.
+	/// If [relative] is set the paths are relative to [root], otherwise they start with [root].
+	/// </summary>
+	/// <returns>number of entries that have been visited</returns>
+	size_t Walk(const std::filesystem::path& root, std::deque<FileEntry>& outfiles, std::deque<std::wstring>& outdirs, bool relative = false);
+
+	/// <summary>
+	/// Recursively lists [root] and passes every directory listing, including metadata, to [visitor] instead of
+	/// collecting the entries. The visitor is called concurrently from all workers.
+	/// </summary>
+	/// <returns>number of entries that have been visited</returns>
+	size_t Walk(const std::filesystem::path& root, const Visitor& visitor);
+
+	/// <summary>
+	/// Only called by a visitor, keeps the walk from descending into the subdirectory [name] of the listing that
+	/// is being visited by [worker]
+	/// </summary>
+	void SkipDirectory(int worker, std::string_view name);
+};
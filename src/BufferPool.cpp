@@ -0,0 +1,166 @@
+#include "BufferPool.h"
+#include <cstdlib>
+#include <new>
+#include <utility>
+
+#ifdef __linux__
+#	include <sys/mman.h>
+#endif
+#ifdef _WIN32
+#	include <malloc.h>
+#endif
+
+std::atomic<bool> BufferPool::_hugePages = false;
+std::atomic<uint64_t> BufferPool::_allocations = 0;
+std::atomic<uint64_t> BufferPool::_hugeAllocations = 0;
+
+namespace
+{
+	void* AlignedAlloc(size_t alignment, size_t size)
+	{
+#ifdef _WIN32
+		return _aligned_malloc(size, alignment);
+#else
+		return std::aligned_alloc(alignment, size);
+#endif
+	}
+
+	void AlignedFree(void* data)
+	{
+#ifdef _WIN32
+		_aligned_free(data);
+#else
+		std::free(data);
+#endif
+	}
+}
+
+BufferPool::Buffer::Buffer(Buffer&& other) noexcept
+{
+	*this = std::move(other);
+}
+
+BufferPool::Buffer& BufferPool::Buffer::operator=(Buffer&& other) noexcept
+{
+	std::swap(_pool, other._pool);
+	std::swap(_block, other._block);
+	std::swap(_size, other._size);
+	return *this;
+}
+
+BufferPool::Buffer::~Buffer()
+{
+	if (_block.data == nullptr)
+		return;
+	std::vector<Block>& free = _pool->_free[(int)_size];
+	if (free.size() < MaxFree)
+		free.push_back(_block);
+	else
+		Free(_size, _block);
+}
+
+BufferPool::~BufferPool()
+{
+	for (int i = 0; i < (int)SizeClass::Count; i++) {
+		for (Block& block : _free[i])
+			Free((SizeClass)i, block);
+	}
+}
+
+BufferPool& BufferPool::Local()
+{
+	thread_local BufferPool pool;
+	return pool;
+}
+
+BufferPool::SizeClass BufferPool::Classify(uint64_t fileSize)
+{
+	if (fileSize < 1024 * 1024)
+		return SizeClass::Small;
+	if (fileSize < 64 * 1024 * 1024)
+		return SizeClass::Medium;
+	return SizeClass::Large;
+}
+
+size_t BufferPool::GetSize(SizeClass size)
+{
+	switch (size) {
+	case SizeClass::Small:
+		return 128 * 1024;
+	case SizeClass::Medium:
+		return 1024 * 1024;
+	default:
+		// a multiple of the huge page size
+		return 4 * 1024 * 1024;
+	}
+}
+
+BufferPool::Block BufferPool::Allocate(SizeClass size)
+{
+	Block block;
+	size_t length = GetSize(size);
+	bool huge = size == SizeClass::Large && _hugePages;
+#ifdef __linux__
+	if (huge) {
+		// explicit huge pages only exist if the administrator has reserved some
+		void* data = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (data != MAP_FAILED) {
+			block.data = (char*)data;
+			block.mapped = true;
+			_allocations++;
+			_hugeAllocations++;
+			return block;
+		}
+	}
+#endif
+	block.data = (char*)AlignedAlloc(huge ? HugePageSize : Alignment, length);
+	if (block.data == nullptr)
+		throw std::bad_alloc();
+#ifdef __linux__
+	// otherwise ask for transparent huge pages, which needs the 2 MiB alignment
+	if (huge && madvise(block.data, length, MADV_HUGEPAGE) == 0)
+		_hugeAllocations++;
+#endif
+	_allocations++;
+	return block;
+}
+
+void BufferPool::Free(SizeClass size, Block block)
+{
+#ifdef __linux__
+	if (block.mapped) {
+		munmap(block.data, GetSize(size));
+		return;
+	}
+#endif
+	AlignedFree(block.data);
+}
+
+BufferPool::Buffer BufferPool::Acquire(SizeClass size)
+{
+	Buffer buffer;
+	buffer._pool = this;
+	buffer._size = size;
+	std::vector<Block>& free = _free[(int)size];
+	if (free.empty() == false) {
+		buffer._block = free.back();
+		free.pop_back();
+	} else
+		buffer._block = Allocate(size);
+	return buffer;
+}
+
+void BufferPool::SetHugePages(bool enabled)
+{
+	_hugePages = enabled;
+}
+
+uint64_t BufferPool::GetAllocations()
+{
+	return _allocations;
+}
+
+uint64_t BufferPool::GetHugePageAllocations()
+{
+	return _hugeAllocations;
+}
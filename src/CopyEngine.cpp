@@ -0,0 +1,933 @@
+#include "CopyEngine.h"
+#include "BufferPool.h"
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <system_error>
+
+#ifdef __linux__
+#	include <cerrno>
+#	include <fcntl.h>
+#	include <linux/fs.h>
+#	include <sys/ioctl.h>
+#	include <sys/sendfile.h>
+#	include <sys/stat.h>
+#	include <unistd.h>
+#endif
+
+#ifdef __linux__
+namespace
+{
+	/// <summary>
+	/// Writes back the range of [out] and drops it from the page cache of both files. Dirty pages cannot be
+	/// dropped, so the writeback of the range is waited for first.
+	/// </summary>
+	void DropRange(int in, int out, uint64_t begin, uint64_t end)
+	{
+		if (end <= begin)
+			return;
+		sync_file_range(out, (off64_t)begin, (off64_t)(end - begin), SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+		posix_fadvise(out, (off_t)begin, (off_t)(end - begin), POSIX_FADV_DONTNEED);
+		posix_fadvise(in, (off_t)begin, (off_t)(end - begin), POSIX_FADV_DONTNEED);
+	}
+
+	/// <summary>
+	/// Reads until [length] bytes or the end of the file have been read
+	/// </summary>
+	/// <returns>the bytes read, -1 with errno set on failure</returns>
+	ssize_t ReadFull(int fd, char* data, size_t length, uint64_t offset)
+	{
+		size_t done = 0;
+		while (done < length) {
+			ssize_t count = pread(fd, data + done, length - done, (off_t)(offset + done));
+			if (count < 0) {
+				if (errno == EINTR)
+					continue;
+				return -1;
+			}
+			if (count == 0)
+				break;
+			done += (size_t)count;
+		}
+		return (ssize_t)done;
+	}
+}
+
+CopyEngine::Writeback::Writeback(int out, uint64_t window, uint64_t offset)
+	: out(out), window(window), started(offset), waited(offset)
+{
+}
+
+size_t CopyEngine::Writeback::Limit(size_t length)
+{
+	return window == 0 ? length : (size_t)std::min<uint64_t>(length, window);
+}
+
+void CopyEngine::Writeback::Advance(uint64_t offset)
+{
+	if (window == 0 || offset - started < window)
+		return;
+	sync_file_range(out, (off64_t)started, (off64_t)(offset - started), SYNC_FILE_RANGE_WRITE);
+	if (started > waited)
+		sync_file_range(out, (off64_t)waited, (off64_t)(started - waited), SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+	waited = started;
+	started = offset;
+}
+
+void CopyEngine::Writeback::Finish(uint64_t offset)
+{
+	if (window != 0 && offset > started)
+		sync_file_range(out, (off64_t)started, (off64_t)(offset - started), SYNC_FILE_RANGE_WRITE);
+}
+
+int CopyEngine::Preallocate(int out, uint64_t size)
+{
+	if (size < PreallocateSize)
+		return 0;
+	// the size is only set by the writes, so a failed copy does not look complete
+	if (fallocate(out, FALLOC_FL_KEEP_SIZE, 0, (off_t)size) == 0)
+		return 0;
+	// filesystems without fallocate just allocate while writing
+	return errno == ENOSPC || errno == EDQUOT ? errno : 0;
+}
+
+int CopyEngine::CopyFileRange(int in, int out, uint64_t& offset, Writeback& writeback)
+{
+	while (true) {
+		loff_t inoffset = (loff_t)offset;
+		loff_t outoffset = (loff_t)offset;
+		ssize_t copied = copy_file_range(in, &inoffset, out, &outoffset, writeback.Limit(ChunkSize), 0);
+		if (copied < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+		if (copied == 0)
+			return 0;
+		offset += (uint64_t)copied;
+		writeback.Advance(offset);
+	}
+}
+
+int CopyEngine::SendFile(int in, int out, uint64_t& offset, Writeback& writeback)
+{
+	if (lseek(out, (off_t)offset, SEEK_SET) < 0)
+		return errno;
+	while (true) {
+		off_t inoffset = (off_t)offset;
+		ssize_t copied = sendfile(out, in, &inoffset, writeback.Limit(ChunkSize));
+		if (copied < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+		if (copied == 0)
+			return 0;
+		offset += (uint64_t)copied;
+		writeback.Advance(offset);
+	}
+}
+
+int CopyEngine::ReadWrite(int in, int out, uint64_t& offset, uint64_t size, Writeback& writeback)
+{
+	BufferPool::Buffer buffer = BufferPool::Local().Acquire(BufferPool::Classify(size));
+	while (true) {
+		ssize_t read = pread(in, buffer.Data(), buffer.Size(), (off_t)offset);
+		if (read < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+		if (read == 0)
+			return 0;
+		for (ssize_t written = 0; written < read;) {
+			ssize_t count = pwrite(out, buffer.Data() + written, (size_t)(read - written), (off_t)(offset + written));
+			if (count < 0) {
+				if (errno == EINTR)
+					continue;
+				return errno;
+			}
+			written += count;
+		}
+		offset += (uint64_t)read;
+		writeback.Advance(offset);
+	}
+}
+
+int CopyEngine::CopySparse(int in, int out, uint64_t size, uint64_t& copied, Writeback& writeback)
+{
+	bool fallback = false;
+	for (uint64_t offset = 0; offset < size;) {
+		off_t data = lseek(in, (off_t)offset, SEEK_DATA);
+		if (data < 0) {
+			// only holes are left
+			if (errno == ENXIO)
+				break;
+			return errno;
+		}
+		off_t hole = lseek(in, data, SEEK_HOLE);
+		if (hole < 0)
+			return errno;
+		uint64_t end = std::min<uint64_t>((uint64_t)hole, size);
+		if ((uint64_t)data >= end)
+			break;
+		if (int err = CopyRange(in, out, (uint64_t)data, end - (uint64_t)data, fallback, writeback); err != 0)
+			return err;
+		copied += end - (uint64_t)data;
+		offset = end;
+	}
+	// the destination has been truncated before, so setting the size creates the trailing hole
+	if (ftruncate(out, (off_t)size) != 0)
+		return errno;
+	return 0;
+}
+
+int CopyEngine::CopyDirect(int in, int out, uint64_t& offset, uint64_t size)
+{
+	BufferPool::Buffer buffer = BufferPool::Local().Acquire(BufferPool::Classify(size));
+	int inflags = fcntl(in, F_GETFL);
+	int outflags = fcntl(out, F_GETFL);
+	if (inflags < 0 || outflags < 0 || fcntl(in, F_SETFL, inflags | O_DIRECT) != 0)
+		return EINVAL;
+	if (fcntl(out, F_SETFL, outflags | O_DIRECT) != 0) {
+		fcntl(in, F_SETFL, inflags);
+		return EINVAL;
+	}
+	int err = 0;
+	while (err == 0) {
+		ssize_t read = pread(in, buffer.Data(), buffer.Size(), (off_t)offset);
+		if (read < 0) {
+			if (errno == EINTR)
+				continue;
+			err = errno;
+			break;
+		}
+		if (read == 0)
+			break;
+		// the last block is padded to the alignment and cut off again afterwards
+		size_t length = ((size_t)read + DirectAlignment - 1) & ~(DirectAlignment - 1);
+		std::memset(buffer.Data() + read, 0, length - (size_t)read);
+		for (size_t written = 0; written < length;) {
+			ssize_t count = pwrite(out, buffer.Data() + written, length - written, (off_t)(offset + written));
+			if (count < 0) {
+				if (errno == EINTR)
+					continue;
+				err = errno;
+				break;
+			}
+			written += (size_t)count;
+		}
+		if (err != 0)
+			break;
+		offset += (uint64_t)read;
+		if (length != (size_t)read) {
+			if (ftruncate(out, (off_t)offset) != 0)
+				err = errno;
+			// an unaligned offset cannot be continued with O_DIRECT, the caller copies the rest if there is any
+			break;
+		}
+	}
+	fcntl(in, F_SETFL, inflags);
+	fcntl(out, F_SETFL, outflags);
+	return err;
+}
+
+int CopyEngine::CopyDropBehind(int in, int out, uint64_t& offset, uint64_t size)
+{
+	BufferPool::Buffer buffer = BufferPool::Local().Acquire(BufferPool::Classify(size));
+	posix_fadvise(in, (off_t)offset, 0, POSIX_FADV_SEQUENTIAL);
+	uint64_t dropped = offset;
+	uint64_t flushed = offset;
+	while (true) {
+		ssize_t read = pread(in, buffer.Data(), buffer.Size(), (off_t)offset);
+		if (read < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+		if (read == 0)
+			break;
+		for (ssize_t written = 0; written < read;) {
+			ssize_t count = pwrite(out, buffer.Data() + written, (size_t)(read - written), (off_t)(offset + written));
+			if (count < 0) {
+				if (errno == EINTR)
+					continue;
+				return errno;
+			}
+			written += count;
+		}
+		offset += (uint64_t)read;
+		if (offset - flushed >= DropWindow) {
+			// start the writeback of this window and drop the previous one, whose writeback had a window's time
+			sync_file_range(out, (off64_t)flushed, (off64_t)(offset - flushed), SYNC_FILE_RANGE_WRITE);
+			DropRange(in, out, dropped, flushed);
+			dropped = flushed;
+			flushed = offset;
+		}
+	}
+	DropRange(in, out, dropped, offset);
+	return 0;
+}
+
+int CopyEngine::CopyRange(int in, int out, uint64_t offset, uint64_t length, bool& fallback, Writeback& writeback)
+{
+	uint64_t end = offset + length;
+	if (!fallback && _reflink != Reflink::Never) {
+		while (offset < end) {
+			loff_t inoffset = (loff_t)offset;
+			loff_t outoffset = (loff_t)offset;
+			ssize_t copied = copy_file_range(in, &inoffset, out, &outoffset, writeback.Limit((size_t)(end - offset)), 0);
+			if (copied < 0) {
+				if (errno == EINTR)
+					continue;
+				if (errno != EXDEV && errno != ENOSYS && errno != EOPNOTSUPP && errno != EINVAL && errno != EBADF)
+					return errno;
+				fallback = true;
+				break;
+			}
+			// the source has shrunk since it was opened
+			if (copied == 0)
+				return 0;
+			offset += (uint64_t)copied;
+			writeback.Advance(offset);
+		}
+		if (!fallback)
+			return 0;
+	}
+	fallback = true;
+	BufferPool::Buffer buffer = BufferPool::Local().Acquire(BufferPool::SizeClass::Large);
+	while (offset < end) {
+		ssize_t read = pread(in, buffer.Data(), (size_t)std::min<uint64_t>(buffer.Size(), end - offset), (off_t)offset);
+		if (read < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+		if (read == 0)
+			return 0;
+		for (ssize_t written = 0; written < read;) {
+			ssize_t count = pwrite(out, buffer.Data() + written, (size_t)(read - written), (off_t)(offset + written));
+			if (count < 0) {
+				if (errno == EINTR)
+					continue;
+				return errno;
+			}
+			written += count;
+		}
+		offset += (uint64_t)read;
+		writeback.Advance(offset);
+	}
+	return 0;
+}
+
+int CopyEngine::UpdateRange(int in, int out, uint64_t offset, uint64_t length, uint64_t& written, Writeback& writeback)
+{
+	BufferPool::Buffer source = BufferPool::Local().Acquire(BufferPool::SizeClass::Large);
+	BufferPool::Buffer destination = BufferPool::Local().Acquire(BufferPool::SizeClass::Large);
+	uint64_t end = offset + length;
+	while (offset < end) {
+		ssize_t read = ReadFull(in, source.Data(), (size_t)std::min<uint64_t>(source.Size(), end - offset), offset);
+		if (read < 0)
+			return errno;
+		// the source has shrunk since it was opened
+		if (read == 0)
+			return 0;
+		ssize_t existing = ReadFull(out, destination.Data(), (size_t)read, offset);
+		if (existing < 0)
+			return errno;
+		for (size_t block = 0; block < (size_t)read; block += DeltaBlockSize) {
+			size_t size = std::min<size_t>(DeltaBlockSize, (size_t)read - block);
+			if (block + size <= (size_t)existing && std::memcmp(source.Data() + block, destination.Data() + block, size) == 0)
+				continue;
+			for (size_t done = 0; done < size;) {
+				ssize_t count = pwrite(out, source.Data() + block + done, size - done, (off_t)(offset + block + done));
+				if (count < 0) {
+					if (errno == EINTR)
+						continue;
+					return errno;
+				}
+				done += (size_t)count;
+			}
+			written += size;
+		}
+		offset += (uint64_t)read;
+		writeback.Advance(offset);
+	}
+	return 0;
+}
+
+bool CopyEngine::IsPrefix(int in, int out, uint64_t size)
+{
+	BufferPool::Buffer source = BufferPool::Local().Acquire(BufferPool::SizeClass::Small);
+	BufferPool::Buffer destination = BufferPool::Local().Acquire(BufferPool::SizeClass::Small);
+	// a rewritten file usually differs at the start, a truncated and refilled one at the end of the old content
+	uint64_t length = std::min<uint64_t>(size, DeltaBlockSize);
+	for (uint64_t offset : { (uint64_t)0, size - length }) {
+		if (ReadFull(in, source.Data(), (size_t)length, offset) != (ssize_t)length || ReadFull(out, destination.Data(), (size_t)length, offset) != (ssize_t)length)
+			return false;
+		if (std::memcmp(source.Data(), destination.Data(), (size_t)length) != 0)
+			return false;
+	}
+	return true;
+}
+#endif
+
+CopyEngine::Split::~Split()
+{
+#ifdef __linux__
+	if (_in >= 0)
+		close(_in);
+	if (_out >= 0)
+		close(_out);
+#endif
+}
+
+std::shared_ptr<CopyEngine::Split> CopyEngine::OpenSplit(const std::filesystem::path& source, const std::filesystem::path& destination, uint64_t chunk)
+{
+	auto split = std::make_shared<Split>();
+	split->_source = source;
+	split->_destination = destination;
+	split->_chunk = std::max<uint64_t>(chunk, 1);
+#ifdef __linux__
+	auto fail = [&split, &source, &destination](const char* what, int err) {
+		// a resized or cloned destination with a new time would look up to date in the next run
+		if (split->_out >= 0) {
+			close(split->_out);
+			split->_out = -1;
+			unlink(destination.c_str());
+		}
+		throw std::filesystem::filesystem_error(what, source, destination, std::error_code(err, std::generic_category()));
+	};
+	split->_in = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+	if (split->_in < 0)
+		fail("cannot open source", errno);
+	struct stat st;
+	if (fstat(split->_in, &st) != 0)
+		fail("cannot stat source", errno);
+	// writing a destination with further names would change them as well, it is replaced by a new file
+	struct stat linked;
+	if (stat(destination.c_str(), &linked) == 0 && linked.st_nlink > 1 && unlink(destination.c_str()) != 0)
+		fail("cannot remove destination", errno);
+	if (IsDelta((uint64_t)st.st_size)) {
+		// an existing destination of the same size is updated in place, everything else is copied
+		split->_out = open(destination.c_str(), O_RDWR | O_CLOEXEC);
+		struct stat existing;
+		if (split->_out >= 0 && (fstat(split->_out, &existing) != 0 || existing.st_size != st.st_size)) {
+			close(split->_out);
+			split->_out = -1;
+		}
+		split->_delta = split->_out >= 0;
+	}
+	// the whole file is cloned before it is split, like a small one in CopyAt
+	if (_reflink == Reflink::Always || (_reflink == Reflink::Auto && !split->_delta)) {
+		if (split->_out < 0)
+			split->_out = open(destination.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, st.st_mode & 07777);
+		if (split->_out < 0)
+			fail("cannot open destination", errno);
+		if (ftruncate(split->_out, 0) != 0)
+			fail("cannot resize destination", errno);
+		if (ioctl(split->_out, FICLONE, split->_in) == 0)
+			split->_cloned = true;
+		else if (_reflink == Reflink::Always)
+			fail("cannot clone file", errno);
+		split->_delta = false;
+	}
+	if (!split->_delta && !split->_cloned) {
+		if (split->_out < 0)
+			split->_out = open(destination.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, st.st_mode & 07777);
+		if (split->_out < 0)
+			fail("cannot open destination", errno);
+		// every thread writes at its own offset, so the destination gets its final size up front
+		if (ftruncate(split->_out, st.st_size) != 0)
+			fail("cannot resize destination", errno);
+		if (fallocate(split->_out, 0, 0, st.st_size) != 0 && (errno == ENOSPC || errno == EDQUOT))
+			fail("cannot preallocate destination", errno);
+	}
+	split->_size = (uint64_t)st.st_size;
+	split->_times[0] = st.st_atim;
+	split->_times[1] = st.st_mtim;
+	split->_mode = st.st_mode & 07777;
+	split->_dropBehind = IsCacheNeutral(split->_size);
+#else
+	if (_reflink == Reflink::Always)
+		throw std::filesystem::filesystem_error("cannot clone file", source, destination, std::make_error_code(std::errc::operation_not_supported));
+	split->_size = std::filesystem::file_size(source);
+#endif
+	split->_remaining = split->_size;
+	return split;
+}
+
+bool CopyEngine::CopySplit(Split& split)
+{
+	// there are no chunks to count down, the first caller finishes the file
+	if (split._size == 0 || split._cloned)
+		return split._next.exchange(std::max<uint64_t>(split._size, 1)) == 0;
+	while (true) {
+		uint64_t offset = split._next.fetch_add(split._chunk);
+		if (offset >= split._size)
+			return false;
+		uint64_t length = std::min(split._chunk, split._size - offset);
+		if (split._error == 0) {
+#ifdef __linux__
+			// every thread has its own window inside its chunk
+			Writeback writeback(split._out, _dirtyBudget / 2, offset);
+			int err = 0;
+			if (split._delta) {
+				uint64_t written = 0;
+				err = UpdateRange(split._in, split._out, offset, length, written, writeback);
+				split._written += written;
+			} else {
+				bool fallback = split._fallback;
+				err = CopyRange(split._in, split._out, offset, length, fallback, writeback);
+				if (fallback)
+					split._fallback = true;
+			}
+			writeback.Finish(offset + length);
+			if (err != 0)
+				split._error = err;
+			else if (split._dropBehind)
+				DropRange(split._in, split._out, offset, offset + length);
+#else
+			// there is no positional copy, the whole file is copied with the first chunk
+			if (offset == 0) {
+				std::error_code err;
+				std::filesystem::copy_file(split._source, split._destination, std::filesystem::copy_options::overwrite_existing, err);
+				if (err)
+					split._error = err.value();
+			}
+#endif
+		}
+		// the thread that completes the last chunk finishes the file, no matter which chunk it copied
+		if (split._remaining.fetch_sub(length) == length)
+			return true;
+	}
+}
+
+CopyEngine::Method CopyEngine::FinishSplit(Split& split)
+{
+	int err = split._error;
+#ifdef __linux__
+	if (err == 0 && futimens(split._out, split._times) != 0)
+		err = errno;
+	if (err == 0 && fchmod(split._out, split._mode) != 0)
+		err = errno;
+	close(split._in);
+	split._in = -1;
+	if (close(split._out) != 0 && err == 0)
+		err = errno;
+	split._out = -1;
+	Method method = split._cloned ? Method::Clone : split._delta ? Method::Delta : split._dropBehind ? Method::DropBehind : split._fallback ? Method::ReadWrite : Method::CopyFileRange;
+#else
+	Method method = Method::Generic;
+#endif
+	if (err != 0) {
+		if (split._delta) {
+#ifdef __linux__
+			// a partly updated file is kept like in CopyAt, the oldest time has it compared again in the next run
+			struct timespec times[2] = { split._times[0], { 0, 0 } };
+			utimensat(AT_FDCWD, split._destination.c_str(), times, 0);
+#endif
+		} else {
+			// a created or truncated destination has its full size from the start, it would look complete
+			std::error_code ignored;
+			std::filesystem::remove(split._destination, ignored);
+		}
+		throw std::filesystem::filesystem_error("cannot copy file", split._source, split._destination, std::error_code(err, std::generic_category()));
+	}
+	_statistics[(int)method].files++;
+	_statistics[(int)method].bytes += split._delta ? split._written.load() : split._size;
+	return method;
+}
+
+#ifdef __linux__
+int CopyEngine::CopyAt(int sourceDirectory, const char* sourceName, int destinationDirectory, const char* destinationName, Method& method, const char*& what)
+{
+	int in = openat(sourceDirectory, sourceName, O_RDONLY | O_CLOEXEC);
+	if (in < 0) {
+		what = "cannot open source";
+		return errno;
+	}
+	struct stat st;
+	if (fstat(in, &st) != 0) {
+		int err = errno;
+		close(in);
+		what = "cannot stat source";
+		return err;
+	}
+	bool created = true;
+	bool delta = false;
+	// size of an existing destination that only the tail has to be appended to
+	uint64_t appended = 0;
+	// times of the existing destination, restored if the append fails
+	struct timespec previous[2] = {};
+	int out = openat(destinationDirectory, destinationName, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, st.st_mode & 07777);
+	if (out < 0 && errno == EEXIST) {
+		created = false;
+		// the existing content is read for a delta update or an append, which are only done if the sizes fit
+		bool read = (IsDelta((uint64_t)st.st_size) || _append) && !IsSparse((uint64_t)st.st_size, (uint64_t)st.st_blocks * 512);
+		out = openat(destinationDirectory, destinationName, (read ? O_RDWR : O_WRONLY) | O_CLOEXEC);
+		if (out < 0 && read) {
+			read = false;
+			out = openat(destinationDirectory, destinationName, O_WRONLY | O_CLOEXEC);
+		}
+		struct stat existing;
+		if (out >= 0 && fstat(out, &existing) == 0) {
+			if (existing.st_nlink > 1) {
+				// writing the file would change the other names of it as well, it is replaced by a new one
+				close(out);
+				out = -1;
+				if (unlinkat(destinationDirectory, destinationName, 0) == 0 || errno == ENOENT) {
+					out = openat(destinationDirectory, destinationName, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, st.st_mode & 07777);
+					created = true;
+				}
+			} else if (read) {
+				previous[0] = existing.st_atim;
+				previous[1] = existing.st_mtim;
+				delta = IsDelta((uint64_t)st.st_size) && existing.st_size == st.st_size;
+				if (_append && existing.st_size > 0 && existing.st_size < st.st_size && IsPrefix(in, out, (uint64_t)existing.st_size))
+					appended = (uint64_t)existing.st_size;
+			}
+		}
+	}
+	if (out < 0) {
+		int err = errno;
+		close(in);
+		what = "cannot open destination";
+		return err;
+	}
+
+	uint64_t offset = 0;
+	method = Method::CopyFileRange;
+	int err = 0;
+	bool noFallback = false;
+	// bytes actually moved by the sparse, the delta and the append copy
+	uint64_t transferred = 0;
+	const char* failure = "cannot copy file";
+	Writeback writeback(out, _dirtyBudget / 2, 0);
+	// a delta update or an append keeps most of the existing content, which a clone would have to throw away
+	bool clone = _reflink == Reflink::Always || (_reflink == Reflink::Auto && !delta && appended == 0);
+	// a clone keeps the tail of a longer destination and fails if an unaligned source does not end where it ends
+	if (clone && !created && ftruncate(out, 0) != 0)
+		err = errno;
+	else if (clone && ioctl(out, FICLONE, in) == 0) {
+		method = Method::Clone;
+		offset = (uint64_t)st.st_size;
+	} else if (_reflink == Reflink::Always) {
+		err = errno;
+		close(in);
+		close(out);
+		// the old content is gone already, an empty file with a new time would never be copied again
+		unlinkat(destinationDirectory, destinationName, 0);
+		what = "cannot clone file";
+		return err;
+	} else if (appended > 0) {
+		// not continued with the methods below, they would start over at the beginning
+		noFallback = true;
+		method = Method::Append;
+		offset = appended;
+		bool fallback = false;
+		err = CopyRange(in, out, appended, (uint64_t)st.st_size - appended, fallback, writeback);
+		if (err == 0) {
+			offset = (uint64_t)st.st_size;
+			transferred = offset - appended;
+			if (IsCacheNeutral(offset))
+				DropRange(in, out, appended, offset);
+		}
+	} else if (delta) {
+		// not continued with the methods below, they would rewrite the whole file
+		noFallback = true;
+		method = Method::Delta;
+		err = UpdateRange(in, out, 0, (uint64_t)st.st_size, transferred, writeback);
+		if (err == 0) {
+			offset = (uint64_t)st.st_size;
+			if (IsCacheNeutral(offset))
+				DropRange(in, out, 0, offset);
+		}
+	} else if (ftruncate(out, 0) != 0)
+		err = errno;
+	else if (IsSparse((uint64_t)st.st_size, (uint64_t)st.st_blocks * 512)) {
+		// neither preallocated nor continued with the methods below, both would fill the holes
+		noFallback = true;
+		method = Method::Sparse;
+		err = CopySparse(in, out, (uint64_t)st.st_size, transferred, writeback);
+		if (err == 0)
+			offset = (uint64_t)st.st_size;
+	} else if ((err = Preallocate(out, (uint64_t)st.st_size)) != 0)
+		failure = "cannot preallocate destination";
+	else if (IsCacheNeutral((uint64_t)st.st_size)) {
+		// not continued with the methods below, they would fill the page cache
+		noFallback = true;
+		method = Method::Direct;
+		err = CopyDirect(in, out, offset, (uint64_t)st.st_size);
+		// the file counts as a buffered copy if any of it had to fall back
+		if (err == EINVAL)
+			method = Method::DropBehind;
+		if (err == EINVAL || (err == 0 && offset < (uint64_t)st.st_size))
+			err = CopyDropBehind(in, out, offset, (uint64_t)st.st_size);
+	} else if (_reflink == Reflink::Never)
+		err = EXDEV;
+	else
+		err = CopyFileRange(in, out, offset, writeback);
+	// not supported between these files, continue with the next method where the last one stopped
+	if (!noFallback && (err == EXDEV || err == ENOSYS || err == EOPNOTSUPP || err == EINVAL || err == EBADF)) {
+		method = Method::SendFile;
+		err = SendFile(in, out, offset, writeback);
+	}
+	if (!noFallback && (err == ENOSYS || err == EINVAL)) {
+		method = Method::ReadWrite;
+		err = ReadWrite(in, out, offset, (uint64_t)st.st_size, writeback);
+	}
+	if (err == 0) {
+		// the tail of the file is not waited for, but it does not pile up with the tails of the next files
+		if (method != Method::Clone)
+			writeback.Finish(offset);
+		// keep the modification time, otherwise the copy looks newer than the source in the next run
+		struct timespec times[2] = { st.st_atim, st.st_mtim };
+		if (futimens(out, times) != 0)
+			err = errno;
+		else if (fchmod(out, st.st_mode & 07777) != 0)
+			err = errno;
+	}
+	// blocks preallocated past the data that has been written would stay allocated otherwise
+	if (err != 0 && method != Method::Clone && method != Method::Sparse && method != Method::Delta)
+		ftruncate(out, (off_t)offset);
+	// a partly written or updated file would look up to date with its new time, the oldest one has it copied again.
+	// a failed append has been cut back to the old content, which keeps its old time and gets its tail next time.
+	if (err != 0) {
+		struct timespec times[2] = { st.st_atim, { 0, 0 } };
+		futimens(out, method == Method::Append ? previous : times);
+	}
+	close(in);
+	if (close(out) != 0 && err == 0)
+		err = errno;
+	if (err != 0) {
+		what = failure;
+		return err;
+	}
+	_statistics[(int)method].files++;
+	_statistics[(int)method].bytes += method == Method::Sparse || method == Method::Delta || method == Method::Append ? transferred : offset;
+	return 0;
+}
+#endif
+
+CopyEngine::Method CopyEngine::Copy(const std::filesystem::path& source, const std::filesystem::path& destination)
+{
+#ifdef __linux__
+	Method method = Method::CopyFileRange;
+	const char* what = nullptr;
+	if (int err = CopyAt(AT_FDCWD, source.c_str(), AT_FDCWD, destination.c_str(), method, what); err != 0)
+		throw std::filesystem::filesystem_error(what, source, destination, std::error_code(err, std::generic_category()));
+	return method;
+#else
+	if (_reflink == Reflink::Always)
+		throw std::filesystem::filesystem_error("cannot clone file", source, destination, std::make_error_code(std::errc::operation_not_supported));
+	std::filesystem::copy_file(source, destination, std::filesystem::copy_options::overwrite_existing);
+	_statistics[(int)Method::Generic].files++;
+	std::error_code err;
+	_statistics[(int)Method::Generic].bytes += std::filesystem::file_size(destination, err);
+	return Method::Generic;
+#endif
+}
+
+void CopyEngine::SetReflink(Reflink reflink)
+{
+	_reflink = reflink;
+}
+
+CopyEngine::Reflink CopyEngine::GetReflink()
+{
+	return _reflink;
+}
+
+std::vector<int> CopyEngine::SyncFiles(const std::vector<std::filesystem::path>& files)
+{
+	std::vector<int> results(files.size(), 0);
+#ifdef __linux__
+	std::vector<int> fds(files.size(), -1);
+	for (size_t i = 0; i < files.size(); i++) {
+		fds[i] = open(files[i].c_str(), O_RDONLY | O_CLOEXEC);
+		if (fds[i] < 0)
+			results[i] = errno;
+		else
+			sync_file_range(fds[i], 0, 0, SYNC_FILE_RANGE_WRITE);
+	}
+	for (size_t i = 0; i < files.size(); i++) {
+		if (fds[i] < 0)
+			continue;
+		if (fdatasync(fds[i]) != 0)
+			results[i] = errno;
+		close(fds[i]);
+	}
+	// a new file is only found again after a crash if the entry of its directory is durable as well
+	std::map<std::filesystem::path, int> directories;
+	for (size_t i = 0; i < files.size(); i++) {
+		auto [itr, inserted] = directories.try_emplace(files[i].parent_path(), 0);
+		if (inserted) {
+			int fd = open(itr->first.empty() ? "." : itr->first.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			if (fd < 0 || fsync(fd) != 0)
+				itr->second = errno;
+			if (fd >= 0)
+				close(fd);
+		}
+		if (results[i] == 0)
+			results[i] = itr->second;
+	}
+#endif
+	return results;
+}
+
+bool CopyEngine::IsEqual(const std::filesystem::path& first, const std::filesystem::path& second)
+{
+	std::error_code err;
+	if (std::filesystem::file_size(first, err) != std::filesystem::file_size(second, err) || err)
+		return false;
+	BufferPool::Buffer one = BufferPool::Local().Acquire(BufferPool::SizeClass::Large);
+	BufferPool::Buffer two = BufferPool::Local().Acquire(BufferPool::SizeClass::Large);
+#ifdef __linux__
+	int a = open(first.c_str(), O_RDONLY | O_CLOEXEC);
+	int b = open(second.c_str(), O_RDONLY | O_CLOEXEC);
+	bool equal = a >= 0 && b >= 0;
+	for (uint64_t offset = 0; equal;) {
+		ssize_t read = ReadFull(a, one.Data(), one.Size(), offset);
+		equal = read >= 0 && ReadFull(b, two.Data(), (size_t)read, offset) == read && std::memcmp(one.Data(), two.Data(), (size_t)read) == 0;
+		if (read <= 0)
+			break;
+		offset += (uint64_t)read;
+	}
+	if (a >= 0)
+		close(a);
+	if (b >= 0)
+		close(b);
+	return equal;
+#else
+	std::ifstream a(first, std::ios::binary);
+	std::ifstream b(second, std::ios::binary);
+	while (a && b) {
+		a.read(one.Data(), one.Size());
+		b.read(two.Data(), two.Size());
+		if (a.gcount() != b.gcount() || std::memcmp(one.Data(), two.Data(), (size_t)a.gcount()) != 0)
+			return false;
+	}
+	return a.eof() && b.eof();
+#endif
+}
+
+bool CopyEngine::IsSparse(uint64_t size, uint64_t allocated)
+{
+#ifdef __linux__
+	// at least one page has to be a hole, small files with inline data have no blocks at all
+	return size >= 4096 && allocated <= size - 4096;
+#else
+	return false;
+#endif
+}
+
+void CopyEngine::SetDirtyBudget(uint64_t bytes)
+{
+	_dirtyBudget = bytes;
+}
+
+uint64_t CopyEngine::GetDirtyBudget()
+{
+	return _dirtyBudget;
+}
+
+void CopyEngine::SetDelta(bool enabled, uint64_t size)
+{
+	_delta = enabled;
+	_deltaSize = size;
+}
+
+bool CopyEngine::IsDelta(uint64_t size)
+{
+#ifdef __linux__
+	return _delta && size >= _deltaSize;
+#else
+	return false;
+#endif
+}
+
+void CopyEngine::SetAppend(bool enabled)
+{
+	_append = enabled;
+}
+
+bool CopyEngine::IsAppend()
+{
+#ifdef __linux__
+	return _append;
+#else
+	return false;
+#endif
+}
+
+void CopyEngine::SetCacheNeutral(bool enabled, uint64_t size)
+{
+	_cacheNeutral = enabled;
+	_cacheNeutralSize = size;
+}
+
+bool CopyEngine::IsCacheNeutral(uint64_t size)
+{
+#ifdef __linux__
+	return _cacheNeutral && size >= _cacheNeutralSize;
+#else
+	return false;
+#endif
+}
+
+CopyEngine::Statistics& CopyEngine::GetStatistics(Method method)
+{
+	return _statistics[(int)method];
+}
+
+void CopyEngine::ResetStatistics()
+{
+	for (auto& statistics : _statistics) {
+		statistics.files = 0;
+		statistics.bytes = 0;
+	}
+}
+
+const char* CopyEngine::GetName(Method method)
+{
+	switch (method) {
+	case Method::Clone:
+		return "clone";
+	case Method::CopyFileRange:
+		return "copy_file_range";
+	case Method::SendFile:
+		return "sendfile";
+	case Method::ReadWrite:
+		return "read/write";
+	case Method::Direct:
+		return "O_DIRECT";
+	case Method::DropBehind:
+		return "drop-behind";
+	case Method::Sparse:
+		return "sparse";
+	case Method::Delta:
+		return "delta";
+	case Method::Append:
+		return "append";
+	case Method::Generic:
+		return "copy_file";
+	default:
+		return "unknown";
+	}
+}
+
+bool CopyEngine::ParseReflink(std::string_view text, Reflink& reflink)
+{
+	if (text == "auto")
+		reflink = Reflink::Auto;
+	else if (text == "always")
+		reflink = Reflink::Always;
+	else if (text == "never")
+		reflink = Reflink::Never;
+	else
+		return false;
+	return true;
+}
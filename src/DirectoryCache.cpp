@@ -0,0 +1,73 @@
+#include "DirectoryCache.h"
+#include <algorithm>
+#include <filesystem>
+
+#ifdef __linux__
+#	include <fcntl.h>
+#	include <sys/resource.h>
+#	include <unistd.h>
+#endif
+
+DirectoryCache::DirectoryCache(size_t capacity)
+{
+	// a batch needs its input and output directory at the same time
+	_capacity = std::max<size_t>(capacity, 2);
+}
+
+DirectoryCache::~DirectoryCache()
+{
+	Clear();
+}
+
+int DirectoryCache::Get(const std::wstring& path)
+{
+#ifdef __linux__
+	if (auto itr = _index.find(path); itr != _index.end()) {
+		_entries.splice(_entries.begin(), _entries, itr->second);
+		return itr->second->second;
+	}
+	// O_PATH is enough for the *at calls and does not need read permission on the directory
+	int fd = open(std::filesystem::path(path).c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	if (_entries.size() >= _capacity) {
+		close(_entries.back().second);
+		_index.erase(_entries.back().first);
+		_entries.pop_back();
+	}
+	_entries.emplace_front(path, fd);
+	_index.insert({ path, _entries.begin() });
+	return fd;
+#else
+	return -1;
+#endif
+}
+
+void DirectoryCache::Clear()
+{
+#ifdef __linux__
+	for (auto& [path, fd] : _entries)
+		close(fd);
+#endif
+	_entries.clear();
+	_index.clear();
+}
+
+size_t DirectoryCache::Size()
+{
+	return _entries.size();
+}
+
+size_t DirectoryCache::GetCapacity(size_t caches, size_t reserved)
+{
+	size_t limit = 1024;
+#ifdef __linux__
+	struct rlimit rlim;
+	if (getrlimit(RLIMIT_NOFILE, &rlim) == 0 && rlim.rlim_cur != RLIM_INFINITY)
+		limit = (size_t)rlim.rlim_cur;
+#endif
+	if (limit <= reserved)
+		return 2;
+	// more than a few hundred directories per worker do not pay off, each batch only needs two of them
+	return std::clamp<size_t>((limit - reserved) / std::max<size_t>(caches, 1), 2, 256);
+}
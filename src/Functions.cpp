@@ -1,247 +1,742 @@
 #include "Functions.h"
+#include "BufferPool.h"
+#include "DirectoryCache.h"
+#include "Manifest.h"
+#include "Walker.h"
 #include <functional>
+#include <random>
 #include <chrono>
 #include <iostream>
 
+#ifdef __linux__
+#	include <cerrno>
+#	include <cstdio>
+#	include <fcntl.h>
+#	include <sys/stat.h>
+#	include <unistd.h>
+#endif
+
 Functions::~Functions()
 {
-	if (_threads.size() > 0)
-		for (std::thread& thread: _threads)
-		{
-			if (thread.joinable())
-				thread.~thread();
-		}
-	_copyQueue.clear();
-	_deleteQueue.clear();
-	_createDirsQueue.clear();
-
-	IFilesSet.clear();
+	for (std::thread& thread : _threads) {
+		if (thread.joinable())
+			thread.join();
+	}
+	ODirSet.clear();
+}
 
-	filesinput.clear();
-	dirsinput.clear();
-	filesoutput.clear();
-	dirsoutput.clear();
+bool Functions::Helper_StealBatch(int worker, Batch& batch)
+{
+	for (size_t i = 1; i < _workerDeques.size(); i++) {
+		WorkerDeque& victim = _workerDeques[(worker + i) % _workerDeques.size()];
+		std::lock_guard<std::mutex> guard(victim.lock);
+		if (victim.batches.empty())
+			continue;
+		batch = std::move(victim.batches.front());
+		victim.batches.pop_front();
+		_stolenCount++;
+		return true;
+	}
+	return false;
+}
 
-	dirstmp.clear();
+bool Functions::Helper_NextBatch(int worker, Batch& batch, bool wait)
+{
+	WorkerDeque& own = _workerDeques[worker];
+	{
+		std::lock_guard<std::mutex> guard(own.lock);
+		if (own.batches.empty() == false) {
+			batch = std::move(own.batches.back());
+			own.batches.pop_back();
+			return true;
+		}
+	}
+	if (!_batches.TryPop(batch) && !Helper_StealBatch(worker, batch)) {
+		if (!wait)
+			return false;
+		// nothing to steal, wait for the scan. Once it is finished only the split parts of big directories and big
+		// files can be left.
+		if (!_batches.Pop(batch))
+			return Helper_WaitForWork(worker, batch);
+	}
+	if (batch.jobs.size() > SplitSize) {
+		// keep the first part and offer the rest of the directory to the other workers. While the scan runs they
+		// wait on the queue and do not steal, so the parts go there as long as it takes them, like split files.
+		for (size_t begin = SplitSize; begin < batch.jobs.size(); begin += SplitSize) {
+			Batch part;
+			part.directory = batch.directory;
+			size_t end = std::min(begin + SplitSize, batch.jobs.size());
+			part.jobs.assign(std::make_move_iterator(batch.jobs.begin() + begin), std::make_move_iterator(batch.jobs.begin() + end));
+			if (!_batches.TryPush(std::move(part))) {
+				std::lock_guard<std::mutex> guard(own.lock);
+				own.batches.emplace_front(std::move(part));
+			}
+		}
+		batch.jobs.resize(SplitSize);
+		Helper_Wake();
+	}
+	return true;
+}
 
-	
-	_copyQueue.~ts_deque();
-	_deleteQueue.~ts_deque();
-	_createDirsQueue.~ts_deque();
+bool Functions::Helper_JoinSplit(Batch& batch)
+{
+	std::lock_guard<std::mutex> guard(_splitsLock);
+	while (_splits.empty() == false) {
+		if (_splits.back().split->IsClaimed()) {
+			_splits.pop_back();
+			continue;
+		}
+		batch.directory.clear();
+		batch.jobs.assign(1, _splits.back());
+		return true;
+	}
+	return false;
+}
 
-	IFilesSet.~ts_deque();
-	IDirSet.clear();
-	OFilesSet.clear();
-	ODirSet.clear();
+bool Functions::Helper_WaitForWork(int worker, Batch& batch)
+{
+	_idle++;
+	while (true) {
+		uint32_t epoch = _idleEpoch.load();
+		if (Helper_StealBatch(worker, batch) || Helper_JoinSplit(batch)) {
+			_idle--;
+			return true;
+		}
+		// nobody is busy anymore, so no new work can show up
+		if (_idle.load() == (int)_workerDeques.size()) {
+			Helper_Wake();
+			return false;
+		}
+		_idleEpoch.wait(epoch);
+	}
+}
 
-	filesinput.~deque();
-	dirsinput.~deque();
-	filesoutput.~deque();
-	dirsoutput.~deque();
+void Functions::Helper_Wake()
+{
+	if (_idle.load() > 0) {
+		_idleEpoch++;
+		_idleEpoch.notify_all();
+	}
+}
 
-	dirstmp.~deque();
+void Functions::Helper_Copied(const Job& job, int outputDirectory, const char* name)
+{
+	_filesCopied++;
+	// size has been captured during the scan
+	_bytesCopied += job.file.info.size;
+	_physicalBytesCopied += std::min(job.file.info.size, job.file.info.allocated);
+	if (_trackDestination) {
+		FileInfo info;
+#ifdef __linux__
+		bool found = outputDirectory >= 0 ? Walker::StatAt(outputDirectory, name, info) : Walker::Stat(_outputPrefix + job.file.path, info);
+#else
+		bool found = Walker::Stat(_outputPrefix + job.file.path, info);
+#endif
+		if (found)
+			_destination.SetFile(Manifest::Encode(job.file.path), info);
+	}
 }
 
-void Functions::Helper_IFiles()
+void Functions::Helper_DetectRenames(bool verify, int processors)
 {
-	std::shared_lock<std::shared_mutex> guard(barrier);
-	for (int i = 0; i < filesinput.size(); i++) {
-		IFilesSet.push_back(filesinput[i].substr(inputprefixlength, filesinput[i].size() - inputprefixlength));
+	struct Orphan
+	{
+		std::wstring path;
+		/// <summary>
+		/// the delete job of the file, null for files in output-only directories
+		/// </summary>
+		Job* job;
+	};
+	// output files without a match in the input, by size and modification time. Empty files are cheaper to
+	// create than to match.
+	boost::unordered_map<std::pair<uint64_t, int64_t>, std::vector<Orphan>> orphans;
+	for (Batch& batch : _held) {
+		for (Job& job : batch.jobs) {
+			if (job.action == Job::Action::Delete && job.file.info.size > 0)
+				orphans[{ job.file.info.size, job.file.info.mtime }].push_back({ job.file.path, &job });
+		}
 	}
+	for (auto& dir : ODirSet) {
+		std::deque<FileEntry> files;
+		std::deque<std::wstring> dirs;
+		Walker walker(processors);
+		walker.Walk(std::filesystem::path(_outputPrefix + dir), files, dirs, true);
+		for (FileEntry& file : files) {
+			if (file.info.size > 0)
+				orphans[{ file.info.size, file.info.mtime }].push_back({ dir + (wchar_t)std::filesystem::path::preferred_separator + file.path, nullptr });
+		}
+	}
+	if (orphans.empty())
+		return;
+
+	boost::unordered_set<const Job*> matched;
+	for (Batch& batch : _held) {
+		for (Job& job : batch.jobs) {
+			// only files that do not exist in the output yet, so the rename never replaces anything
+			if (job.action != Job::Action::Copy || job.existing > 0 || job.file.info.size == 0)
+				continue;
+			auto itr = orphans.find({ job.file.info.size, job.file.info.mtime });
+			if (itr == orphans.end())
+				continue;
+			std::vector<Orphan>& candidates = itr->second;
+			// without a content check the match has to be unique
+			if (!verify && candidates.size() != 1)
+				continue;
+			std::filesystem::path destination = _outputPrefix + job.file.path;
+			for (size_t i = 0; i < candidates.size(); i++) {
+				std::filesystem::path source = _outputPrefix + candidates[i].path;
+				if (verify && !CopyEngine::IsEqual(_inputPrefix + job.file.path, source))
+					continue;
+				std::error_code err;
+				std::filesystem::rename(source, destination, err);
+				if (err)
+					break;
+#ifdef __linux__
+				chmod(destination.c_str(), job.file.info.mode & 07777);
+#endif
+				matched.insert(&job);
+				if (candidates[i].job != nullptr)
+					matched.insert(candidates[i].job);
+				_filesToCopy--;
+				_bytesToCopy -= job.file.info.size;
+				_physicalBytesToCopy -= std::min(job.file.info.size, job.file.info.allocated);
+				_renameCount++;
+				_renameBytes += job.file.info.size;
+				if (_trackDestination) {
+					FileInfo info;
+					_destination.EraseFile(Manifest::Encode(candidates[i].path));
+					if (Walker::Stat(destination, info))
+						_destination.SetFile(Manifest::Encode(job.file.path), info);
+				}
+				candidates.erase(candidates.begin() + i);
+				break;
+			}
+		}
+	}
+	for (Batch& batch : _held)
+		std::erase_if(batch.jobs, [&matched](const Job& job) { return matched.contains(&job); });
+	std::erase_if(_held, [](const Batch& batch) { return batch.jobs.empty(); });
 }
 
-void Functions::Helper_OFiles() 
+void Functions::Helper_LinkFiles()
 {
-	std::shared_lock<std::shared_mutex> guard(barrier);
-	for (int i = 0; i < filesoutput.size(); i++) {
-		OFilesSet.insert(filesoutput[i].substr(outputprefixlength, filesoutput[i].size() - outputprefixlength));
+	for (HardLink& link : _links) {
+		std::filesystem::path target = _outputPrefix + link.target;
+		std::filesystem::path path = _outputPrefix + link.file.path;
+		FileInfo info;
+		std::error_code err;
+		if (Walker::Stat(target, info) && info.size == link.file.info.size && info.mtime == link.file.info.mtime) {
+			std::filesystem::remove(path, err);
+			if (!err)
+				std::filesystem::create_hard_link(target, path, err);
+			if (!err) {
+				_linkCount++;
+				_filesCopied++;
+				if (_trackDestination)
+					_destination.SetFile(Manifest::Encode(link.file.path), info);
+				continue;
+			}
+		}
+		// the copy of the target has failed or the filesystem has no hard links
+		_bytesToCopy += link.file.info.size;
+		_physicalBytesToCopy += std::min(link.file.info.size, link.file.info.allocated);
+		Helper_RunJob({ Job::Action::Copy, link.file, nullptr, 0, 0 });
 	}
+	_links.clear();
+	_inodes.clear();
+}
+
+bool Functions::Helper_IsLarge(const Job& job)
+{
+	// sparse files are not split, the chunks would fill their holes, and appends only copy the tail anyway
+	return job.action == Job::Action::Copy && !_move && job.file.info.size >= LargeFileSize && _workerDeques.size() > 1 && !CopyEngine::IsSparse(job.file.info.size, job.file.info.allocated) && !Helper_IsAppend(job);
 }
-void Functions::Helper_IDirSet() 
+
+bool Functions::Helper_IsAppend(const Job& job)
 {
-	std::shared_lock<std::shared_mutex> guard(barrier);
-	for (int i = 0; i < dirsinput.size(); i++) {
-		IDirSet.insert(dirsinput[i].substr(inputprefixlength, dirsinput[i].size() - inputprefixlength));
+	return _engine.IsAppend() && job.existing > 0 && job.existing < job.file.info.size;
+}
+
+void Functions::Helper_SplitFile(const Job& job)
+{
+	Job part{ Job::Action::Part, job.file, _engine.OpenSplit(_inputPrefix + job.file.path, _outputPrefix + job.file.path), job.existing, job.existingLinks };
+	// a cloned file is complete already, there are no chunks to share
+	if (part.split->IsCloned()) {
+		Helper_CopyPart(part);
+		return;
 	}
+	{
+		std::lock_guard<std::mutex> guard(_splitsLock);
+		_splits.push_back(part);
+	}
+	_splitCount++;
+	// wakes workers waiting for the scan, idle workers at the end of the run find the file in _splits
+	std::wstring directory = std::filesystem::path(job.file.path).parent_path().wstring();
+	for (size_t i = 1; i < _workerDeques.size(); i++) {
+		Batch batch{ directory, { part } };
+		if (!_batches.TryPush(std::move(batch)))
+			break;
+	}
+	Helper_Wake();
+	Helper_CopyPart(part);
 }
-void Functions::Helper_ODirSet() 
+
+void Functions::Helper_CopyPart(const Job& part)
 {
-	std::shared_lock<std::shared_mutex> guard(barrier);
-	for (int i = 0; i < dirsoutput.size(); i++) {
-		ODirSet.insert(dirsoutput[i].substr(outputprefixlength, dirsoutput[i].size() - outputprefixlength));
+	if (!_engine.CopySplit(*part.split))
+		return;
+	try {
+		if (_engine.FinishSplit(*part.split) == CopyEngine::Method::Clone)
+			_bytesCloned += part.file.info.size;
+		Helper_Copied(part);
+	} catch (std::filesystem::filesystem_error& e) {
+		errors.push_back("[ERROR] [Copy File] " + std::string(e.what()));
 	}
 }
-void Functions::Helper_CreateDirs()
+
+#ifdef __linux__
+void Functions::Helper_RunJobAt(const Job& job, int inputDirectory, int outputDirectory)
 {
-	std::error_code err;
-	std::unique_lock<std::mutex> guard(_waiter);
-	while (!_doneCreatingDirs || _createDirsQueue.size() > 0)
-	{
-		_waiterCond.wait_for(guard, std::chrono::milliseconds(10), [this]() { return _createDirsQueue.empty() == false || _doneCreatingDirs; });
-		try
-		{
-			std::wstring dir = _createDirsQueue.get_pop_front();
-			try {
-				std::filesystem::create_directories(std::filesystem::path(_outputPrefix + dir), err);
-			} catch (std::filesystem::filesystem_error& e) {
-				errors.push_back("[ERROR] [Create Directory] " + std::string(e.what()));
+	// full paths are only built for error messages
+	std::filesystem::path name = std::filesystem::path(job.file.path).filename();
+	const char* what = nullptr;
+	int err = 0;
+	switch (job.action) {
+	case Job::Action::Copy:
+		if (_move) {
+			if (renameat(inputDirectory, name.c_str(), outputDirectory, name.c_str()) != 0) {
+				err = errno;
+				what = "cannot rename file";
+				// another filesystem, the source is removed once the copy is durable
+				if (err == EXDEV) {
+					CopyEngine::Method method = CopyEngine::Method::CopyFileRange;
+					err = _engine.CopyAt(inputDirectory, name.c_str(), outputDirectory, name.c_str(), method, what);
+					if (err == 0)
+						_retire.Push(Job(job));
+				}
 			}
+		} else {
+			CopyEngine::Method method = CopyEngine::Method::CopyFileRange;
+			err = _engine.CopyAt(inputDirectory, name.c_str(), outputDirectory, name.c_str(), method, what);
+			if (err == 0 && method == CopyEngine::Method::Clone)
+				_bytesCloned += job.file.info.size;
 		}
-		catch (std::exception&) {
-
+		if (err == 0)
+			Helper_Copied(job, outputDirectory, name.c_str());
+		else {
+			std::filesystem::filesystem_error e(what, _inputPrefix + job.file.path, _outputPrefix + job.file.path, std::error_code(err, std::generic_category()));
+			errors.push_back("[ERROR] [Copy File] " + std::string(e.what()));
+		}
+		break;
+	case Job::Action::Delete:
+		// a file that is already gone is not an error, like std::filesystem::remove
+		if (unlinkat(outputDirectory, name.c_str(), 0) != 0 && errno != ENOENT) {
+			std::filesystem::filesystem_error e("cannot remove file", _outputPrefix + job.file.path, std::error_code(errno, std::generic_category()));
+			errors.push_back("[ERROR] [Delete File] " + std::string(e.what()));
+			break;
 		}
+		cdeleted++;
+		if (_trackDestination)
+			_destination.EraseFile(Manifest::Encode(job.file.path));
+		break;
+	case Job::Action::Part:
+		Helper_CopyPart(job);
+		break;
 	}
 }
+#endif
 
-void Functions::DoStuff()
+void Functions::Helper_RunJob(const Job& job, int inputDirectory, int outputDirectory)
 {
-	std::error_code err;
-	std::mutex wait;
-	std::unique_lock<std::mutex> guard(wait);
-	while (!_doneStuff || !_copyQueue.empty() || !_deleteQueue.empty()) {
-		_waiterCond.wait_for(guard, std::chrono::milliseconds(10), [this]() { return _doneStuff || !_copyQueue.empty() || !_deleteQueue.empty(); });
+	const std::wstring& path = job.file.path;
+#ifdef __linux__
+	if (inputDirectory >= 0 && outputDirectory >= 0 && !Helper_IsLarge(job)) {
+		Helper_RunJobAt(job, inputDirectory, outputDirectory);
+		return;
+	}
+#endif
+	switch (job.action) {
+	case Job::Action::Copy:
 		try {
-			std::wstring copy = _copyQueue.get_pop_front();
-			try {
-				if (_move) {
-					std::filesystem::rename(_inputPrefix + copy, _outputPrefix + copy);
-				} else {
-					std::filesystem::copy_file(_inputPrefix + copy, _outputPrefix + copy, std::filesystem::copy_options::overwrite_existing);
-				}
-				_filesCopied++;
-				_bytesCopied += (std::filesystem::file_size(_outputPrefix + copy, err));
-			} catch (std::filesystem::filesystem_error& e) {
-				errors.push_back("[ERROR] [Copy File] " + std::string(e.what()));
+			if (_move) {
+				std::error_code err;
+				std::filesystem::rename(_inputPrefix + path, _outputPrefix + path, err);
+				// another filesystem, the source is removed once the copy is durable
+				if (err == std::errc::cross_device_link) {
+					_engine.Copy(_inputPrefix + path, _outputPrefix + path);
+					_retire.Push(Job(job));
+				} else if (err)
+					throw std::filesystem::filesystem_error("cannot rename file", _inputPrefix + path, _outputPrefix + path, err);
+				Helper_Copied(job);
+			} else if (Helper_IsLarge(job)) {
+				Helper_SplitFile(job);
+			} else {
+				if (_engine.Copy(_inputPrefix + path, _outputPrefix + path) == CopyEngine::Method::Clone)
+					_bytesCloned += job.file.info.size;
+				Helper_Copied(job);
 			}
-		} catch (std::exception&) {
+		} catch (std::filesystem::filesystem_error& e) {
+			errors.push_back("[ERROR] [Copy File] " + std::string(e.what()));
 		}
+		break;
+	case Job::Action::Part:
+		Helper_CopyPart(job);
+		break;
+	case Job::Action::Delete:
 		try {
-			std::wstring del = _deleteQueue.get_pop_front();
-			try {
-				std::filesystem::remove(_outputPrefix + del);
-				cdeleted++;
-			} catch (std::filesystem::filesystem_error& e) {
-				errors.push_back("[ERROR] [Delete File] " + std::string(e.what()));
+			std::filesystem::remove(_outputPrefix + path);
+			cdeleted++;
+			if (_trackDestination)
+				_destination.EraseFile(Manifest::Encode(path));
+		} catch (std::filesystem::filesystem_error& e) {
+			errors.push_back("[ERROR] [Delete File] " + std::string(e.what()));
+		}
+		break;
+	}
+}
+
+void Functions::DoStuff(int worker)
+{
+	DirectoryCache directories(_directoryCacheSize);
+	Batch batch;
+	while (Helper_NextBatch(worker, batch)) {
+		// all jobs of a batch are in the same directory, so it is only resolved once on both sides
+		int input = directories.Get(_inputPrefix + batch.directory);
+		int output = directories.Get(_outputPrefix + batch.directory);
+		for (Job& job : batch.jobs)
+			Helper_RunJob(job, input, output);
+	}
+}
+
+void Functions::DoRetire(bool verify)
+{
+	std::vector<Job> jobs;
+	Job job;
+	while (_retire.Pop(job)) {
+		jobs.push_back(std::move(job));
+		while (jobs.size() < RetireBatch && _retire.TryPop(job))
+			jobs.push_back(std::move(job));
+		// copies that differ keep their source
+		if (verify) {
+			std::erase_if(jobs, [this](const Job& job) {
+				if (CopyEngine::IsEqual(_inputPrefix + job.file.path, _outputPrefix + job.file.path))
+					return false;
+				errors.push_back("[ERROR] [Move File] copy differs from source, source kept: " + std::filesystem::path(_inputPrefix + job.file.path).string());
+				return true;
+			});
+		}
+		// only the copies of the group are written back, not everything else on the output filesystem
+		std::vector<std::filesystem::path> copies;
+		for (Job& retired : jobs)
+			copies.push_back(std::filesystem::path(_outputPrefix + retired.file.path));
+		std::vector<int> synced = CopyEngine::SyncFiles(copies);
+		for (size_t i = 0; i < jobs.size(); i++) {
+			Job& retired = jobs[i];
+			if (synced[i] != 0) {
+				std::filesystem::filesystem_error e("cannot sync copy", copies[i], std::error_code(synced[i], std::generic_category()));
+				errors.push_back("[ERROR] [Move File] " + std::string(e.what()) + ", source kept");
+				continue;
 			}
-		} catch (std::exception&) {
+			std::error_code err;
+			std::filesystem::remove(std::filesystem::path(_inputPrefix + retired.file.path), err);
+			if (err) {
+				errors.push_back("[ERROR] [Move File] cannot remove source: " + err.message() + ": " + std::filesystem::path(_inputPrefix + retired.file.path).string());
+				continue;
+			}
+			_retiredFiles++;
+			_retiredBytes += retired.file.info.size;
 		}
+		jobs.clear();
 	}
 }
 
-void Functions::Helper_SortFiles()
+void Functions::DoStuffUring(int worker, unsigned depth)
 {
-	std::filesystem::file_time_type ITime;
-	std::filesystem::file_time_type OTime;
-	std::error_code err;
-	while (IFilesSet.size() > 0) {
-		try {
-			std::wstring file = IFilesSet.get_pop_front();
-			if (file.empty() == false && OFilesSet.contains(file)) {
-				ITime = std::filesystem::last_write_time(_inputPrefix + file, err);
-				OTime = std::filesystem::last_write_time(_outputPrefix + file, err);
-				// if input file time is newer than output file time
-				if (ITime > OTime) {
-					_copyQueue.push_back(file);
-					_bytesToCopy += std::filesystem::file_size(std::filesystem::path(_inputPrefix + file), err);
-					_filesToCopy++;
-				// if output file time is newer only overwrite if force is enabled
-				} else if (ITime < OTime) {
-					if (_force) {
-						_copyQueue.push_back(file);
-						_bytesToCopy += std::filesystem::file_size(std::filesystem::path(_inputPrefix + file), err);
-						_filesToCopy++;
-					}
-				// if times are identical overwrite is overwriteexisting is enabled, or file sizes are different
-				} else {
-					if (_overwriteexisting || std::filesystem::file_size(_inputPrefix + file) != std::filesystem::file_size(_outputPrefix + file)) {
-						_copyQueue.push_back(file);
-						_bytesToCopy += std::filesystem::file_size(std::filesystem::path(_inputPrefix + file), err);
-						_filesToCopy++;
-					}
+	// jobs in flight, indexed by the tag passed to the executor
+	std::vector<Job> running(depth);
+	std::vector<uint64_t> free;
+	for (unsigned i = 0; i < depth; i++)
+		free.push_back(i);
+	UringExecutor executor(depth, [this, &running, &free](uint64_t tag, int error, uint64_t bytes) {
+		Job& job = running[tag];
+		if (error == 0) {
+			_uringBytes += bytes;
+			Helper_Copied(job);
+		} else {
+			std::filesystem::filesystem_error e("cannot copy file", _inputPrefix + job.file.path, _outputPrefix + job.file.path, std::error_code(error, std::generic_category()));
+			errors.push_back("[ERROR] [Copy File] " + std::string(e.what()));
+		}
+		free.push_back(tag);
+	});
+	if (!executor.Init()) {
+		errors.push_back("[ERROR] [io_uring] cannot create ring, using blocking copies");
+		DoStuff(worker);
+		return;
+	}
+
+	Batch batch;
+	size_t next = 0;
+	bool finished = false;
+	while (!finished || executor.InFlight() > 0) {
+		while (!finished && !executor.Full()) {
+			if (next == batch.jobs.size()) {
+				next = 0;
+				batch.jobs.clear();
+				// only block for new work if nothing is in flight
+				if (!Helper_NextBatch(worker, batch, executor.InFlight() == 0)) {
+					if (executor.InFlight() == 0)
+						finished = true;
+					break;
 				}
-				OFilesSet.erase(file);
-			} else {
-				_copyQueue.push_back(file);
-				_bytesToCopy += std::filesystem::file_size(std::filesystem::path(_inputPrefix + file), err);
-				_filesToCopy++;
+				continue;
 			}
-		} catch (std::exception&) {}
+			Job& job = batch.jobs[next++];
+			// the ring cannot clone, preallocate or write back in a window, files that need any of it take the blocking
+			// path, and it would truncate a linked file in place
+			if (job.action != Job::Action::Copy || _move || _engine.GetReflink() == CopyEngine::Reflink::Always || _engine.GetDirtyBudget() > 0 || job.file.info.size >= CopyEngine::PreallocateSize || job.existingLinks > 1 || Helper_IsLarge(job) || _engine.IsCacheNeutral(job.file.info.size) || _engine.IsDelta(job.file.info.size) || Helper_IsAppend(job) || CopyEngine::IsSparse(job.file.info.size, job.file.info.allocated)) {
+				Helper_RunJob(job);
+				continue;
+			}
+			uint64_t tag = free.back();
+			free.pop_back();
+			running[tag] = std::move(job);
+			executor.Submit(_inputPrefix + running[tag].file.path, _outputPrefix + running[tag].file.path, tag);
+		}
+		if (!executor.Run(true)) {
+			// the files in flight have failed already, the rest of the work is copied with blocking calls
+			errors.push_back("[ERROR] [io_uring] cannot submit to the ring, using blocking copies");
+			for (; next < batch.jobs.size(); next++)
+				Helper_RunJob(batch.jobs[next]);
+			if (!finished)
+				DoStuff(worker);
+			return;
+		}
 	}
 }
 
-boost::unordered_set<std::wstring> Functions::GetFilesRelative(std::filesystem::path inputPath)
+bool Functions::Helper_CheckSpace(const std::filesystem::path& outputPath)
 {
-	boost::unordered_set<std::wstring> files;
+	// files that are overwritten are truncated before they are written, so their blocks are available again
+	uint64_t needed = _physicalBytesToCopy > _bytesReplaced ? _physicalBytesToCopy - _bytesReplaced : 0;
+	std::error_code err;
+	std::filesystem::space_info space = std::filesystem::space(outputPath, err);
+	if (!err && _assumedSpace > 0)
+		space.available = _assumedSpace;
+	if (err) {
+		errors.push_back("[ERROR] [Check Space] " + err.message() + ": " + outputPath.string());
+		return true;
+	}
+	printf("Space check:                      %llu bytes needed, %llu bytes available\n", (unsigned long long)needed, (unsigned long long)space.available);
+	if (needed <= space.available)
+		return true;
+	errors.push_back("[ERROR] [Check Space] " + std::to_string(needed) + " bytes are needed, but only " + std::to_string(space.available) + " bytes are available in " + outputPath.string() + ", nothing has been copied");
+	return false;
+}
 
-	if (std::filesystem::exists(inputPath) == false) {
-		return files;
+bool Functions::Helper_VerifyDestination(int percent)
+{
+	if (percent <= 0)
+		return true;
+	std::minstd_rand random((unsigned int)std::chrono::steady_clock::now().time_since_epoch().count());
+	std::uniform_int_distribution<int> distribution(0, 99);
+	size_t checked = 0;
+	size_t mismatched = 0;
+	for (auto& listing : _destination.GetListings()) {
+		std::wstring dir = Manifest::Decode(listing.path);
+		if (dir.empty() == false)
+			dir.append(1, std::filesystem::path::preferred_separator);
+		for (auto& [name, expected] : listing.files) {
+			if (distribution(random) >= percent)
+				continue;
+			checked++;
+			FileInfo info;
+			if (!Walker::Stat(_outputPrefix + dir + Manifest::Decode(name), info) || info.size != expected.size || info.mtime != expected.mtime)
+				mismatched++;
+		}
 	}
-	std::wstring _inputPrefix = inputPath.wstring().append(1, std::filesystem::path::preferred_separator);
-	int inputprefixlength = (int)_inputPrefix.length();
+	printf("\tverified %zu files, %zu changed", checked, mismatched);
+	return mismatched == 0;
+}
 
-	std::unordered_set<std::wstring> filesinput;
-	std::unordered_set<std::wstring> dirsinput;
-	auto inputiter = std::filesystem::recursive_directory_iterator(inputPath, std::filesystem::directory_options::follow_directory_symlink);
-	//iterate over all entries
-	try {
-		for (auto const& dir_entry : inputiter) {
-			//printf("%zd %ws\n", count, dir_entry.path().wstring().c_str());
-			//count++;
-			if (dir_entry.is_directory())
-				dirsinput.insert(dir_entry.path().wstring());
+bool Functions::Helper_MoveDirectory(const std::wstring& dir)
+{
+	std::error_code err;
+	std::filesystem::rename(std::filesystem::path(_inputPrefix + dir), std::filesystem::path(_outputPrefix + dir), err);
+	if (err)
+		return false;
+	_movedDirectories++;
+	if (_trackDestination) {
+		// the moved tree is only listed, nothing has to be compared
+		_destination.AddDirectory(Manifest::Encode(dir));
+		Walker walker(1);
+		walker.Walk(std::filesystem::path(_outputPrefix + dir), [this, &dir](int, const std::wstring& relative, const DirListing& listing) {
+			DirListing moved = listing;
+			moved.path = Manifest::Encode(relative.empty() ? dir : dir + (wchar_t)std::filesystem::path::preferred_separator + relative);
+			_destination.Add(moved);
+		});
+	}
+	return true;
+}
+
+void Functions::Helper_DiffDirectory(Walker& walker, int worker, const std::wstring& relative, const DirListing& input)
+{
+	bool fresh = false;
+	if (relative.empty() == false) {
+		std::lock_guard<std::mutex> guard(_freshLock);
+		fresh = _freshDirectories.erase(relative) > 0;
+	}
+	DirListing output;
+	bool exists = false;
+	if (fresh)
+		_freshCount++;
+	else if (_trustDestination)
+		exists = _destination.GetListing(input.path, output);
+	else {
+		exists = Walker::ReadDirectory(_outputPrefix + relative, output);
+		if (exists && _trackDestination) {
+			output.path = input.path;
+			_destination.Add(output);
+		}
+	}
+
+	std::wstring prefix = relative;
+	if (prefix.empty() == false)
+		prefix.append(1, std::filesystem::path::preferred_separator);
+
+	// compares the metadata captured during the scan, no additional syscalls are made here
+	Batch batch;
+	batch.directory = relative;
+	boost::unordered_map<std::string_view, const FileInfo*> ofiles;
+	for (auto& [name, info] : output.files)
+		ofiles.insert({ name, &info });
+	for (auto& [name, info] : input.files) {
+		bool copy = true;
+		uint64_t replaced = 0;
+		uint64_t existing = 0;
+		uint32_t existingLinks = 0;
+		if (auto itr = fresh ? ofiles.end() : ofiles.find(name); itr != ofiles.end()) {
+			const FileInfo& out = *itr->second;
+			replaced = out.allocated;
+			existing = out.size;
+			existingLinks = out.links;
+			// if input file time is newer than output file time
+			if (info.mtime > out.mtime)
+				copy = true;
+			// if output file time is newer only overwrite if force is enabled
+			else if (info.mtime < out.mtime)
+				copy = _force;
+			// if times are identical overwrite is overwriteexisting is enabled, or file sizes are different
 			else
-				filesinput.insert(dir_entry.path().wstring());
+				copy = _overwriteexisting || info.size != out.size;
+			ofiles.erase(itr);
+		}
+		// every name of a hard linked file is registered, so that further names are linked instead of copied
+		if (info.links > 1 && !_move) {
+			std::lock_guard<std::mutex> guard(_linksLock);
+			auto [first, inserted] = _inodes.try_emplace({ info.device, info.inode }, prefix + Manifest::Decode(name));
+			if (!inserted && copy) {
+				_links.push_back({ { prefix + Manifest::Decode(name), info }, first->second });
+				_filesToCopy++;
+				continue;
+			}
+		}
+		if (copy) {
+			_bytesToCopy += info.size;
+			_physicalBytesToCopy += std::min(info.size, info.allocated);
+			_bytesReplaced += replaced;
+			_filesToCopy++;
+			batch.jobs.push_back({ Job::Action::Copy, { prefix + Manifest::Decode(name), info }, nullptr, existing, existingLinks });
 		}
-	} catch (std::filesystem::filesystem_error& e) {
-		printf("ERROR: %s\n", e.what());
 	}
-	for (auto file : filesinput) {
-		files.insert(file.substr(inputprefixlength, file.size() - inputprefixlength));
+	// remaining output files have no match in the input
+	if (_deletewithoutmatch) {
+		for (auto& [name, info] : ofiles)
+			batch.jobs.push_back({ Job::Action::Delete, { prefix + Manifest::Decode(name), *info }, nullptr, 0, 0 });
 	}
+	if (batch.jobs.empty() == false) {
+		_batchCount++;
+		if (_holdBatches) {
+			std::lock_guard<std::mutex> guard(_heldLock);
+			_held.push_back(std::move(batch));
+		} else
+			_batches.Push(std::move(batch));
+	}
+
+	// subdirectories have to exist before the walker queues them and their files are copied
+	boost::unordered_set<std::string_view> odirs(output.dirs.begin(), output.dirs.end());
+	for (auto& name : input.dirs) {
+		if (odirs.erase(name) > 0)
+			continue;
+		std::wstring dir = prefix + Manifest::Decode(name);
+		// nothing to merge, the whole subtree is moved at once and not walked any further. Other filesystems
+		// are handled file by file.
+		if (_move && Helper_MoveDirectory(dir)) {
+			walker.SkipDirectory(worker, name);
+			continue;
+		}
+		std::error_code err;
+		bool created = std::filesystem::create_directory(std::filesystem::path(_outputPrefix + dir), err);
+		if (err) {
+			errors.push_back("[ERROR] [Create Directory] " + err.message() + ": " + std::filesystem::path(_outputPrefix + dir).string());
+			continue;
+		}
+		if (_trackDestination)
+			_destination.AddDirectory(Manifest::Encode(dir));
+		// an output directory that has just been created is still empty
+		if (created) {
+			std::lock_guard<std::mutex> guard(_freshLock);
+			_freshDirectories.insert(std::move(dir));
+		}
+	}
+	if (_deletewithoutmatch && odirs.empty() == false) {
+		std::lock_guard<std::mutex> guard(_odirsLock);
+		for (auto& name : odirs)
+			ODirSet.insert(prefix + Manifest::Decode(name));
+	}
+}
+
+boost::unordered_set<std::wstring> Functions::GetFilesRelative(std::filesystem::path inputPath, int threads)
+{
+	boost::unordered_set<std::wstring> files;
+	boost::unordered_set<std::wstring> dirs;
+	GetFilesRelative(inputPath, files, dirs, threads);
 	return files;
 }
 
-void Functions::GetFilesRelative(std::filesystem::path inputPath, boost::unordered_set<std::wstring>& files, boost::unordered_set<std::wstring>& dirs)
+void Functions::GetFilesRelative(std::filesystem::path inputPath, boost::unordered_set<std::wstring>& files, boost::unordered_set<std::wstring>& dirs, int threads)
 {
 	if (std::filesystem::exists(inputPath) == false) {
 		return;
 	}
-	std::wstring _inputPrefix = inputPath.wstring().append(1, std::filesystem::path::preferred_separator);
-	int inputprefixlength = (int)_inputPrefix.length();
 
-	auto inputiter = std::filesystem::recursive_directory_iterator(inputPath, std::filesystem::directory_options::follow_directory_symlink);
-	//iterate over all entries
-	try {
-		for (auto const& dir_entry : inputiter) {
-			if (dir_entry.is_directory())
-				dirs.insert(dir_entry.path().wstring().substr(inputprefixlength, dir_entry.path().wstring().size() - inputprefixlength));
-			else
-				files.insert(dir_entry.path().wstring().substr(inputprefixlength, dir_entry.path().wstring().size() - inputprefixlength));
-		}
-	} catch (std::filesystem::filesystem_error& e) {
-		printf("ERROR: %s\n", e.what());
-	}
+	std::deque<std::wstring> filesinput;
+	std::deque<std::wstring> dirsinput;
+	Walker walker(threads);
+	walker.Walk(inputPath, filesinput, dirsinput, true);
+	for (auto& file : filesinput)
+		files.insert(std::move(file));
+	for (auto& dir : dirsinput)
+		dirs.insert(std::move(dir));
 }
-void Functions::GetFiles(std::filesystem::path inputPath, std::deque<std::wstring>& outfiles, std::deque<std::wstring>& outdirs)
+
+size_t Functions::GetFiles(std::filesystem::path inputPath, std::deque<std::wstring>& outfiles, std::deque<std::wstring>& outdirs, int threads)
 {
 	if (std::filesystem::exists(inputPath) == false) {
-		return;
+		return 0;
 	}
 
-	auto inputiter = std::filesystem::recursive_directory_iterator(inputPath, std::filesystem::directory_options::follow_directory_symlink);
-	//iterate over all entries
-	try {
-		for (auto const& dir_entry : inputiter) {
-			//printf("%zd %ws\n", count, dir_entry.path().wstring().c_str());
-			//count++;
-			if (dir_entry.is_directory())
-				outdirs.push_back(dir_entry.path().wstring());
-			else
-				outfiles.push_back(dir_entry.path().wstring());
-		}
-	} catch (std::filesystem::filesystem_error& e) {
-		printf("ERROR: %s\n", e.what());
+	Walker walker(threads);
+	return walker.Walk(inputPath, outfiles, outdirs);
+}
+
+size_t Functions::GetFiles(std::filesystem::path inputPath, std::deque<FileEntry>& outfiles, std::deque<std::wstring>& outdirs, int threads)
+{
+	if (std::filesystem::exists(inputPath) == false) {
+		return 0;
 	}
+
+	Walker walker(threads);
+	return walker.Walk(inputPath, outfiles, outdirs);
 }
 
 void Functions::ReconstitueSymlinks(std::vector<std::filesystem::path> folders)
@@ -289,147 +784,223 @@ void Functions::ReconstitueSymlinks(std::vector<std::filesystem::path> folders)
 	std::cout << "End Reconstitution.\n";
 }
 
-void Functions::Copy(std::filesystem::path inputPath, std::filesystem::path outputPath, bool deletewithoutmatch, bool overwriteexisting, bool force, bool move, int processors)
+void Functions::Copy(std::filesystem::path inputPath, std::filesystem::path outputPath, bool deletewithoutmatch, bool overwriteexisting, bool force, bool move, int processors, const CopyOptions& options)
 {
 	_finished = false;
 	_move = move;
 	_overwriteexisting = overwriteexisting;
 	_force = force;
+	_deletewithoutmatch = deletewithoutmatch;
+	_batches.Reopen();
+	_retire.Reopen();
+	_retiredFiles = 0;
+	_retiredBytes = 0;
+	if (move)
+		_retirer = std::thread(&Functions::DoRetire, this, options.verifyMoves);
+	_batchCount = 0;
+	_stolenCount = 0;
+	_idle = 0;
+	_splitCount = 0;
+	_splits.clear();
+	_linkCount = 0;
+	_renameCount = 0;
+	_renameBytes = 0;
+	_movedDirectories = 0;
+	_freshCount = 0;
+	_freshDirectories.clear();
+	_links.clear();
+	_inodes.clear();
+	_engine.ResetStatistics();
+	_engine.SetCacheNeutral(options.cacheNeutral, options.cacheNeutralSize);
+	_engine.SetDelta(options.delta, options.deltaSize);
+	_engine.SetAppend(options.append);
+	BufferPool::SetHugePages(options.hugePages);
+	_engine.SetDirtyBudget(options.dirtyBudget);
+	uint64_t allocations = BufferPool::GetAllocations();
+	uint64_t hugeAllocations = BufferPool::GetHugePageAllocations();
+	_uringBytes = 0;
+	_engine.SetReflink(options.reflink);
 
 	if (std::filesystem::exists(outputPath) == false) {
 		std::filesystem::create_directories(outputPath);
 		// crash if we fail
 	}
 
-	printf("Find all files...");
-	auto begin = std::chrono::steady_clock::now();
-
-	std::thread thr1([inputPath, outfiles = &filesinput, outdirs = &dirsinput]() {
-		GetFiles(inputPath, *outfiles, *outdirs);
-	});
-	std::thread thr2([outputPath, outfiles = &filesoutput, outdirs = &dirsoutput]() {
-		GetFiles(outputPath, *outfiles, *outdirs);
-	});
-	thr1.join();
-	thr2.join();
-	std::cout << Utility::FormatTimeNS(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count()).c_str() << "\n";
-	// we have found all files, generate prefixes
-	printf("Generate prefixes...");
-	begin = std::chrono::steady_clock::now();
+	Manifest manifest;
+	if (options.manifest.empty() == false) {
+		printf("Load manifest...");
+		auto begin = std::chrono::steady_clock::now();
+		if (manifest.Load(options.manifest))
+			std::cout << Utility::FormatTimeNS(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count()).c_str() << "\t" << manifest.GetDirectoryCount() << " directories, " << manifest.GetFileCount() << " files\n";
+		else
+			printf("\tnot found, scanning everything\n");
+	}
 
 	_inputPrefix = inputPath.wstring().append(1, std::filesystem::path::preferred_separator);
 	_outputPrefix = outputPath.wstring().append(1, std::filesystem::path::preferred_separator);
-	inputprefixlength = (int)_inputPrefix.length();
-	outputprefixlength = (int)_outputPrefix.length();
-
-	std::cout << Utility::FormatTimeNS(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count()).c_str() << "\n";
-	// calculate files we need
-	printf("Calculate files...");
-	begin = std::chrono::steady_clock::now();
 
-	// remove prefixes from all paths
-	{
-		std::thread th1 = std::thread(&Functions::Helper_IFiles, this);
-		std::thread th2 = std::thread(&Functions::Helper_OFiles, this);
-		std::thread th3 = std::thread(&Functions::Helper_IDirSet, this);
-		std::thread th4 = std::thread(&Functions::Helper_ODirSet, this);
-		th1.join();
-		th2.join();
-		th3.join();
-		th4.join();
-	}
-
-	{
-		std::unique_lock<std::shared_mutex> guard(barrier);
+	_trustDestination = false;
+	_trackDestination = options.destinationManifest.empty() == false;
+	_destination.Clear();
+	if (_trackDestination) {
+		printf("Load destination manifest...");
+		auto begin = std::chrono::steady_clock::now();
+		Manifest destination;
+		if (destination.Load(options.destinationManifest)) {
+			_destination.Load(destination);
+			destination.Unload();
+			_trustDestination = Helper_VerifyDestination(options.verifyManifest);
+			if (!_trustDestination)
+				_destination.Clear();
+			std::cout << "\t" << Utility::FormatTimeNS(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count()).c_str() << (_trustDestination ? "\n" : "\tscanning output\n");
+		} else
+			printf("\tnot found, scanning output\n");
+		// an interrupted run must not leave a manifest behind that does not match the output anymore
+		std::error_code err;
+		std::filesystem::remove(options.destinationManifest, err);
 	}
 
-	std::cout << Utility::FormatTimeNS(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count()).c_str() << "\n";
-	printf("Handle directories...");
-	begin = std::chrono::steady_clock::now();
-
-	std::error_code err;
+	// the input tree is walked once, every directory is compared with its output counterpart as soon as it has
+	// been listed and the resulting jobs go straight to the workers
+	printf("Scan and copy...\n");
+	auto begin = std::chrono::steady_clock::now();
 
-	//std::thread thcr = std::thread(&Functions::Helper_CreateDirs, this);
-	// 
-	for (auto dir : IDirSet) {
-		if (ODirSet.contains(dir)) {
-			ODirSet.erase(dir);
-			//IDirSet.erase(dir);
-			continue;
-		}
-		else
+	_activeCopy = true;
+	_workerDeques = std::vector<WorkerDeque>(processors);
+	bool uring = options.executor == CopyOptions::Executor::Uring;
+	if (uring && !UringExecutor::IsSupported()) {
+		errors.push_back("[ERROR] [io_uring] not supported by the kernel, using blocking copies");
+		uring = false;
+	}
+	// every worker has two files open at a time, or two per file in flight with io_uring
+	_directoryCacheSize = DirectoryCache::GetCapacity(processors, 64 + processors * (uring ? 2 * options.uringDepth : 4));
+	auto startWorkers = [this, processors, uring, &options]() {
+		for (int i = 0; i < processors; i++)
 		{
-			//IDirSet.erase(dir);
-			//_createDirsQueue.push_back(dir);
-			try {
-				std::filesystem::create_directories(std::filesystem::path(_outputPrefix + dir), err);
-			} catch (std::filesystem::filesystem_error& e) {
-				errors.push_back("[ERROR] [Create Directory] " + std::string(e.what()));
-			}
+			if (uring)
+				_threads.emplace_back(std::thread(&Functions::DoStuffUring, this, i, options.uringDepth));
+			else
+				_threads.emplace_back(std::thread(&Functions::DoStuff, this, i));
 		}
-	}
-	IDirSet.clear();
-	//_doneCreatingDirs = true;
-	//thcr.join();
-
-	std::cout << Utility::FormatTimeNS(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count()).c_str() << "\n";
-	printf("Actually Copy...\n");
+	};
+	// the space check needs the complete scan, so the batches are held back until it has passed. Moves within
+	// the same filesystem do not need any space.
+	_bytesReplaced = 0;
+	bool checkSpace = options.checkSpace && !move;
+	// renames are only detected between files that would be copied and deleted otherwise
+	bool detectRenames = options.detectRenames && deletewithoutmatch && !move;
+	_holdBatches = checkSpace || detectRenames;
+	if (!_holdBatches)
+		startWorkers();
 
-	_activeCopy = true;
-	for (int i = 0; i < processors; i++)
-	{
-		_threads.emplace_back(std::thread(&Functions::DoStuff, this));
+	size_t entries = 0;
+	int64_t scantime = Manifest::Now();
+	Walker walkerinput(processors);
+	walkerinput.SetCache(&manifest);
+	walkerinput.RecordListings(options.manifest.empty() == false);
+	if (std::filesystem::exists(inputPath)) {
+		entries = walkerinput.Walk(inputPath, [this, &walkerinput](int worker, const std::wstring& relative, const DirListing& listing) {
+			Helper_DiffDirectory(walkerinput, worker, relative, listing);
+		});
 	}
-
-	// check for existing files
-	// remaining in IFiles are new files
-	// remaining in OFiles are those to delete
-	
 	{
-		std::thread th1 = std::thread(&Functions::Helper_SortFiles, this);
-		std::thread th2 = std::thread(&Functions::Helper_SortFiles, this);
-		std::thread th3 = std::thread(&Functions::Helper_SortFiles, this);
-		std::thread th4 = std::thread(&Functions::Helper_SortFiles, this);
-		th1.join();
-		th2.join();
-		th3.join();
-		th4.join();
+		int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count();
+		std::cout << "Scan finished..." << Utility::FormatTimeNS(ns).c_str() << "\t" << entries << " entries, " << (size_t)((double)entries / ((double)ns / 1000000000 + 1e-9)) << " entries/s";
+		if (manifest.IsLoaded())
+			std::cout << ", " << walkerinput.GetReusedDirectories() << " directories from manifest";
+		std::cout << "\n";
 	}
 
-	if (deletewithoutmatch) {
-		printf("Deleting files without match...");
-		begin = std::chrono::steady_clock::now();
-		for (auto const& file : OFilesSet) {
-			_deleteQueue.push_back(_outputPrefix + file);
-			cdeleted++;
+	if (_holdBatches) {
+		_holdBatches = false;
+		if (detectRenames) {
+			printf("Detect renames...");
+			auto renamebegin = std::chrono::steady_clock::now();
+			Helper_DetectRenames(options.verifyRenames, processors);
+			std::cout << Utility::FormatTimeNS(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - renamebegin).count()).c_str() << "\t" << _renameCount << " files, " << _renameBytes << " bytes renamed\n";
+		}
+		bool fits = !checkSpace || Helper_CheckSpace(outputPath);
+		if (fits) {
+			startWorkers();
+			for (Batch& batch : _held)
+				_batches.Push(std::move(batch));
+		}
+		_held.clear();
+		if (!fits) {
+			// nothing is copied, linked or deleted, but the renames are done and both manifests are still written
+			_links.clear();
+			ODirSet.clear();
 		}
-		std::cout << Utility::FormatTimeNS(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count()).c_str() << "\n";
 	}
 
-	_doneStuff = true;
+	_batches.Close();
 	
-	for (int i = 0; i < processors; i++) {
-		_threads[i].join();
-	}
+	for (std::thread& thread : _threads)
+		thread.join();
 	_threads.clear();
+	if (_retirer.joinable()) {
+		_retire.Close();
+		_retirer.join();
+	}
+	// the links need the copies of their targets, which are only certain to be done now
+	Helper_LinkFiles();
 	_activeCopy = false;
+	std::cout << "Copy finished..." << Utility::FormatTimeNS(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count()).c_str() << "\t" << _batchCount.load() << " directories, " << _stolenCount.load() << " batches stolen, " << _splitCount.load() << " files split, " << _freshCount.load() << " directories new\n";
+	for (int i = 0; i < (int)CopyEngine::Method::Count; i++) {
+		CopyEngine::Statistics& statistics = _engine.GetStatistics((CopyEngine::Method)i);
+		if (statistics.files > 0)
+			std::cout << "\t" << CopyEngine::GetName((CopyEngine::Method)i) << ":\t" << statistics.files.load() << " files, " << statistics.bytes.load() << " bytes\n";
+	}
+	if (_retiredFiles > 0)
+		std::cout << "\tmoved across filesystems:\t" << _retiredFiles.load() << " files, " << _retiredBytes.load() << " bytes released\n";
+	if (_movedDirectories > 0)
+		std::cout << "\tmoved:\t" << _movedDirectories.load() << " directories with a single rename\n";
+	if (_linkCount > 0)
+		std::cout << "\thard links:\t" << _linkCount << " files\n";
+	if (uring)
+		std::cout << "\tio_uring:\t" << _uringBytes.load() << " bytes\n";
+	std::cout << "\tbuffers:\t" << BufferPool::GetAllocations() - allocations << " allocated, " << BufferPool::GetHugePageAllocations() - hugeAllocations << " with huge pages\n";
 
 	// clean up
 
 	if (deletewithoutmatch) {
-		printf("Deleting folder without math...");
+		printf("Deleting folder without match...");
 		begin = std::chrono::steady_clock::now();
-		for (auto const dir : ODirSet) {
+		for (auto const& dir : ODirSet) {
 			try {
 				std::filesystem::remove_all(_outputPrefix + dir);
+				if (_trackDestination)
+					_destination.EraseDirectory(Manifest::Encode(dir));
 			} catch (std::filesystem::filesystem_error&) {
-				// don't output, since we could try to delete folders we already deleted, since we are in alphabetical order
+				// don't output, the folder may have been removed in the meantime
 			}
 		}
 		ODirSet.clear();
 		std::cout << Utility::FormatTimeNS(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count()).c_str() << "\n";
 	}
 
+	if (options.manifest.empty() == false) {
+		printf("Write manifest...");
+		begin = std::chrono::steady_clock::now();
+		// the mapping has to be released before the file can be replaced
+		manifest.Unload();
+		std::vector<DirListing> listings = walkerinput.TakeListings();
+		if (Manifest::Write(options.manifest, listings, scantime))
+			std::cout << Utility::FormatTimeNS(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count()).c_str() << "\n";
+		else
+			errors.push_back("[ERROR] [Write Manifest] cannot write " + options.manifest.string());
+	}
+
+	if (_trackDestination) {
+		printf("Write destination manifest...");
+		begin = std::chrono::steady_clock::now();
+		std::vector<DirListing> listings = _destination.GetListings();
+		if (Manifest::Write(options.destinationManifest, listings, scantime))
+			std::cout << Utility::FormatTimeNS(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count()).c_str() << "\n";
+		else
+			errors.push_back("[ERROR] [Write Manifest] cannot write " + options.destinationManifest.string());
+	}
+
 	_finished = true;
 }
 
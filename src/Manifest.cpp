@@ -0,0 +1,526 @@
+#include "Manifest.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+
+#ifdef _WIN32
+#	include <windows.h>
+#else
+#	include <fcntl.h>
+#	include <sys/mman.h>
+#	include <sys/stat.h>
+#	include <time.h>
+#	include <unistd.h>
+#endif
+
+static_assert(sizeof(Manifest::Header) == 152 && sizeof(Manifest::DirRecord) == 32 && sizeof(Manifest::FileRecord) == 48, "manifest records must not contain padding");
+
+namespace
+{
+	/// <summary>
+	/// directories modified less than this before the manifest was created may have changed within the same
+	/// timestamp tick and are never served from the manifest
+	/// </summary>
+	constexpr std::chrono::seconds RacyInterval(2);
+
+	void PutVarint(std::string& out, uint64_t value)
+	{
+		while (value >= 0x80) {
+			out.push_back((char)(value | 0x80));
+			value >>= 7;
+		}
+		out.push_back((char)value);
+	}
+
+	bool GetVarint(const uint8_t*& pos, const uint8_t* end, uint64_t& value)
+	{
+		value = 0;
+		for (int shift = 0; shift < 64 && pos < end; shift += 7) {
+			uint8_t byte = *pos++;
+			value |= (uint64_t)(byte & 0x7F) << shift;
+			if ((byte & 0x80) == 0)
+				return true;
+		}
+		return false;
+	}
+
+	/// <summary>
+	/// Front-codes [strings]: every string stores the length of the prefix it shares with its predecessor and the
+	/// remaining suffix. Every RestartInterval strings the full string is stored and its offset recorded.
+	/// </summary>
+	void EncodeStrings(const std::vector<std::string_view>& strings, std::string& data, std::vector<uint64_t>& restarts)
+	{
+		std::string_view last;
+		for (size_t i = 0; i < strings.size(); i++) {
+			size_t shared = 0;
+			if (i % Manifest::RestartInterval == 0)
+				restarts.push_back(data.size());
+			else
+				while (shared < last.size() && shared < strings[i].size() && last[shared] == strings[i][shared])
+					shared++;
+			PutVarint(data, shared);
+			PutVarint(data, strings[i].size() - shared);
+			data.append(strings[i].substr(shared));
+			last = strings[i];
+		}
+	}
+
+	constexpr char Separator = (char)std::filesystem::path::preferred_separator;
+
+	/// <summary>
+	/// Splits [path] into parent directory and name
+	/// </summary>
+	std::pair<std::string, std::string> Split(const std::string& path)
+	{
+		size_t pos = path.find_last_of(Separator);
+		if (pos == std::string::npos)
+			return { std::string(), path };
+		return { path.substr(0, pos), path.substr(pos + 1) };
+	}
+
+	void Align(std::string& out)
+	{
+		while (out.size() % 8 != 0)
+			out.push_back('\0');
+	}
+
+	template <class T>
+	void Append(std::string& out, const T& value)
+	{
+		out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+	}
+
+	Manifest::StringTable AppendStrings(std::string& out, const std::vector<std::string_view>& strings)
+	{
+		std::string data;
+		std::vector<uint64_t> restarts;
+		EncodeStrings(strings, data, restarts);
+
+		Manifest::StringTable table{};
+		table.count = strings.size();
+		Align(out);
+		table.restartOffset = out.size();
+		for (uint64_t offset : restarts)
+			Append(out, offset);
+		table.dataOffset = out.size();
+		table.dataSize = data.size();
+		out.append(data);
+		return table;
+	}
+}
+
+Manifest::~Manifest()
+{
+	Unload();
+}
+
+bool Manifest::Load(const std::filesystem::path& file)
+{
+	Unload();
+#ifdef _WIN32
+	HANDLE handle = CreateFileW(file.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (handle == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(handle, &size) || size.QuadPart < (LONGLONG)sizeof(Header)) {
+		CloseHandle(handle);
+		return false;
+	}
+	HANDLE mapping = CreateFileMappingW(handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mapping == nullptr) {
+		CloseHandle(handle);
+		return false;
+	}
+	void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (data == nullptr) {
+		CloseHandle(mapping);
+		CloseHandle(handle);
+		return false;
+	}
+	_file = handle;
+	_mapping = mapping;
+	_data = static_cast<const uint8_t*>(data);
+	_size = (size_t)size.QuadPart;
+#else
+	int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(Header)) {
+		close(fd);
+		return false;
+	}
+	void* data = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return false;
+	_data = static_cast<const uint8_t*>(data);
+	_size = (size_t)st.st_size;
+#endif
+	_header = reinterpret_cast<const Header*>(_data);
+	if (!Validate()) {
+		Unload();
+		return false;
+	}
+	return true;
+}
+
+void Manifest::Unload()
+{
+	if (_data == nullptr)
+		return;
+#ifdef _WIN32
+	UnmapViewOfFile(_data);
+	CloseHandle(_mapping);
+	CloseHandle(_file);
+	_mapping = nullptr;
+	_file = nullptr;
+#else
+	munmap(const_cast<uint8_t*>(_data), _size);
+#endif
+	_data = nullptr;
+	_size = 0;
+	_header = nullptr;
+}
+
+bool Manifest::Validate() const
+{
+	if (_header->magic != Magic || _header->version != Version)
+		return false;
+	auto inside = [this](uint64_t offset, uint64_t count, uint64_t size) {
+		return offset <= _size && count <= (_size - offset) / size;
+	};
+	auto table = [&inside](const StringTable& strings) {
+		uint64_t restarts = (strings.count + RestartInterval - 1) / RestartInterval;
+		return inside(strings.restartOffset, restarts, sizeof(uint64_t)) && inside(strings.dataOffset, strings.dataSize, 1);
+	};
+	return inside(_header->dirOffset, _header->dirCount, sizeof(DirRecord)) &&
+	       inside(_header->fileOffset, _header->fileCount, sizeof(FileRecord)) &&
+	       table(_header->dirPaths) && _header->dirPaths.count == _header->dirCount &&
+	       table(_header->fileNames) && _header->fileNames.count == _header->fileCount &&
+	       table(_header->childNames) && _header->childNames.count == _header->childCount;
+}
+
+bool Manifest::IsLoaded() const
+{
+	return _header != nullptr;
+}
+
+size_t Manifest::GetDirectoryCount() const
+{
+	return IsLoaded() ? (size_t)_header->dirCount : 0;
+}
+
+size_t Manifest::GetFileCount() const
+{
+	return IsLoaded() ? (size_t)_header->fileCount : 0;
+}
+
+std::string Manifest::GetString(const StringTable& table, uint64_t index) const
+{
+	const uint64_t* restarts = reinterpret_cast<const uint64_t*>(_data + table.restartOffset);
+	const uint8_t* end = _data + table.dataOffset + table.dataSize;
+	const uint8_t* pos = _data + table.dataOffset + restarts[index / RestartInterval];
+	std::string value;
+	for (uint64_t i = index - index % RestartInterval; i <= index; i++) {
+		uint64_t shared = 0;
+		uint64_t length = 0;
+		if (pos >= end || !GetVarint(pos, end, shared) || !GetVarint(pos, end, length) || shared > value.size() || length > (uint64_t)(end - pos))
+			return {};
+		value.resize(shared);
+		value.append(reinterpret_cast<const char*>(pos), length);
+		pos += length;
+	}
+	return value;
+}
+
+bool Manifest::FindDirectory(std::string_view path, uint64_t& index) const
+{
+	const StringTable& table = _header->dirPaths;
+	if (table.count == 0)
+		return false;
+	// restart points hold complete strings, find the last block that starts at or before [path]
+	uint64_t low = 0;
+	uint64_t high = (table.count + RestartInterval - 1) / RestartInterval;
+	while (high - low > 1) {
+		uint64_t mid = (low + high) / 2;
+		if (GetString(table, mid * RestartInterval) <= path)
+			low = mid;
+		else
+			high = mid;
+	}
+	const uint64_t* restarts = reinterpret_cast<const uint64_t*>(_data + table.restartOffset);
+	const uint8_t* end = _data + table.dataOffset + table.dataSize;
+	const uint8_t* pos = _data + table.dataOffset + restarts[low];
+	std::string value;
+	for (uint64_t i = low * RestartInterval; i < table.count && i < (low + 1) * RestartInterval; i++) {
+		uint64_t shared = 0;
+		uint64_t length = 0;
+		if (!GetVarint(pos, end, shared) || !GetVarint(pos, end, length) || shared > value.size() || length > (uint64_t)(end - pos))
+			return false;
+		value.resize(shared);
+		value.append(reinterpret_cast<const char*>(pos), length);
+		pos += length;
+		if (value == path) {
+			index = i;
+			return true;
+		}
+		if (value > path)
+			return false;
+	}
+	return false;
+}
+
+void Manifest::Read(uint64_t index, DirListing& listing) const
+{
+	const DirRecord& dir = reinterpret_cast<const DirRecord*>(_data + _header->dirOffset)[index];
+	const FileRecord* files = reinterpret_cast<const FileRecord*>(_data + _header->fileOffset);
+	listing.path = GetString(_header->dirPaths, index);
+	listing.mtime = dir.mtime;
+	listing.files.clear();
+	listing.dirs.clear();
+	if (dir.firstFile + dir.fileCount > _header->fileCount || dir.firstChild + dir.childCount > _header->childCount)
+		return;
+	for (uint64_t i = dir.firstFile; i < dir.firstFile + dir.fileCount; i++) {
+		const FileRecord& record = files[i];
+		listing.files.push_back({ GetString(_header->fileNames, i), FileInfo{ record.size, record.allocated, record.mtime, record.inode, record.device, record.mode, record.links } });
+	}
+	for (uint64_t i = dir.firstChild; i < dir.firstChild + dir.childCount; i++)
+		listing.dirs.push_back(GetString(_header->childNames, i));
+}
+
+bool Manifest::GetListing(std::string_view path, int64_t mtime, DirListing& listing) const
+{
+	if (!IsLoaded())
+		return false;
+	uint64_t index = 0;
+	if (!FindDirectory(path, index))
+		return false;
+	const DirRecord& dir = reinterpret_cast<const DirRecord*>(_data + _header->dirOffset)[index];
+#ifdef _WIN32
+	int64_t racy = std::chrono::duration_cast<std::filesystem::file_time_type::duration>(RacyInterval).count();
+#else
+	int64_t racy = std::chrono::duration_cast<std::chrono::nanoseconds>(RacyInterval).count();
+#endif
+	if (dir.mtime != mtime || mtime >= _header->created - racy)
+		return false;
+	Read(index, listing);
+	return true;
+}
+
+bool Manifest::Write(const std::filesystem::path& file, std::vector<DirListing>& listings, int64_t created)
+{
+	std::sort(listings.begin(), listings.end(), [](const DirListing& a, const DirListing& b) { return a.path < b.path; });
+
+	std::vector<std::string_view> dirPaths;
+	std::vector<std::string_view> fileNames;
+	std::vector<std::string_view> childNames;
+	std::vector<DirRecord> dirs;
+	std::vector<FileRecord> files;
+	for (auto& listing : listings) {
+		// keeps siblings with a common prefix next to each other
+		std::sort(listing.files.begin(), listing.files.end(), [](auto& a, auto& b) { return a.first < b.first; });
+		std::sort(listing.dirs.begin(), listing.dirs.end());
+		dirPaths.push_back(listing.path);
+		dirs.push_back({ listing.mtime, files.size(), childNames.size(), (uint32_t)listing.files.size(), (uint32_t)listing.dirs.size() });
+		for (auto& [name, info] : listing.files) {
+			fileNames.push_back(name);
+			files.push_back({ info.size, info.allocated, info.mtime, info.inode, info.device, info.mode, info.links });
+		}
+		for (auto& name : listing.dirs)
+			childNames.push_back(name);
+	}
+
+	Header header{};
+	header.magic = Magic;
+	header.version = Version;
+	header.created = created;
+	header.dirCount = dirs.size();
+	header.fileCount = files.size();
+	header.childCount = childNames.size();
+
+	std::string out;
+	out.reserve(sizeof(Header) + dirs.size() * sizeof(DirRecord) + files.size() * (sizeof(FileRecord) + 16));
+	Append(out, header);
+	Align(out);
+	header.dirOffset = out.size();
+	out.append(reinterpret_cast<const char*>(dirs.data()), dirs.size() * sizeof(DirRecord));
+	Align(out);
+	header.fileOffset = out.size();
+	out.append(reinterpret_cast<const char*>(files.data()), files.size() * sizeof(FileRecord));
+	header.dirPaths = AppendStrings(out, dirPaths);
+	header.fileNames = AppendStrings(out, fileNames);
+	header.childNames = AppendStrings(out, childNames);
+	std::memcpy(out.data(), &header, sizeof(Header));
+
+	std::filesystem::path tmp = file;
+	tmp += ".tmp";
+	{
+		std::ofstream stream(tmp, std::ios::binary | std::ios::trunc);
+		if (!stream.write(out.data(), (std::streamsize)out.size()))
+			return false;
+	}
+	std::error_code err;
+	std::filesystem::rename(tmp, file, err);
+	return !err;
+}
+
+int64_t Manifest::Now()
+{
+#ifdef _WIN32
+	return std::filesystem::file_time_type::clock::now().time_since_epoch().count();
+#else
+	timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+std::string Manifest::Encode(std::wstring_view path)
+{
+#ifdef _WIN32
+	std::u8string utf8 = std::filesystem::path(path).u8string();
+	return std::string(utf8.begin(), utf8.end());
+#else
+	return std::filesystem::path(path).native();
+#endif
+}
+
+std::wstring Manifest::Decode(std::string_view name)
+{
+#ifdef _WIN32
+	return std::filesystem::path(std::u8string(name.begin(), name.end())).wstring();
+#else
+	return std::filesystem::path(name).wstring();
+#endif
+}
+
+TreeState::Directory& TreeState::GetDirectory(const std::string& path)
+{
+	auto itr = _dirs.find(path);
+	if (itr != _dirs.end())
+		return itr->second;
+	if (path.empty() == false) {
+		auto [parent, name] = Split(path);
+		GetDirectory(parent).dirs.insert(name);
+	}
+	return _dirs[path];
+}
+
+void TreeState::EraseDirectoryRecursive(const std::string& path)
+{
+	auto itr = _dirs.find(path);
+	if (itr == _dirs.end())
+		return;
+	boost::unordered_set<std::string> children = std::move(itr->second.dirs);
+	_dirs.erase(itr);
+	for (auto& child : children)
+		EraseDirectoryRecursive(path.empty() ? child : path + Separator + child);
+}
+
+void TreeState::Load(const Manifest& manifest)
+{
+	std::lock_guard<std::mutex> guard(_lock);
+	_dirs.clear();
+	manifest.ForEach([this](DirListing& listing) {
+		Directory& dir = _dirs[listing.path];
+		dir.mtime = listing.mtime;
+		for (auto& [name, info] : listing.files)
+			dir.files.insert({ std::move(name), info });
+		for (auto& name : listing.dirs)
+			dir.dirs.insert(std::move(name));
+	});
+}
+
+void TreeState::Add(std::vector<DirListing>& listings)
+{
+	std::lock_guard<std::mutex> guard(_lock);
+	for (auto& listing : listings) {
+		Directory& dir = _dirs[listing.path];
+		dir.mtime = listing.mtime;
+		for (auto& [name, info] : listing.files)
+			dir.files.insert({ std::move(name), info });
+		for (auto& name : listing.dirs)
+			dir.dirs.insert(std::move(name));
+	}
+}
+
+void TreeState::Add(const DirListing& listing)
+{
+	std::lock_guard<std::mutex> guard(_lock);
+	Directory& dir = _dirs[listing.path];
+	dir.mtime = listing.mtime;
+	dir.files.insert(listing.files.begin(), listing.files.end());
+	dir.dirs.insert(listing.dirs.begin(), listing.dirs.end());
+}
+
+void TreeState::Clear()
+{
+	std::lock_guard<std::mutex> guard(_lock);
+	_dirs.clear();
+}
+
+size_t TreeState::GetDirectoryCount()
+{
+	std::lock_guard<std::mutex> guard(_lock);
+	return _dirs.size();
+}
+
+bool TreeState::GetListing(const std::string& path, DirListing& listing)
+{
+	std::lock_guard<std::mutex> guard(_lock);
+	auto itr = _dirs.find(path);
+	if (itr == _dirs.end())
+		return false;
+	listing.path = path;
+	listing.mtime = itr->second.mtime;
+	listing.files.assign(itr->second.files.begin(), itr->second.files.end());
+	listing.dirs.assign(itr->second.dirs.begin(), itr->second.dirs.end());
+	return true;
+}
+
+void TreeState::SetFile(const std::string& path, const FileInfo& info)
+{
+	auto [parent, name] = Split(path);
+	std::lock_guard<std::mutex> guard(_lock);
+	GetDirectory(parent).files[name] = info;
+}
+
+void TreeState::EraseFile(const std::string& path)
+{
+	auto [parent, name] = Split(path);
+	std::lock_guard<std::mutex> guard(_lock);
+	if (auto itr = _dirs.find(parent); itr != _dirs.end())
+		itr->second.files.erase(name);
+}
+
+void TreeState::AddDirectory(const std::string& path)
+{
+	std::lock_guard<std::mutex> guard(_lock);
+	GetDirectory(path);
+}
+
+void TreeState::EraseDirectory(const std::string& path)
+{
+	auto [parent, name] = Split(path);
+	std::lock_guard<std::mutex> guard(_lock);
+	if (auto itr = _dirs.find(parent); itr != _dirs.end())
+		itr->second.dirs.erase(name);
+	EraseDirectoryRecursive(path);
+}
+
+std::vector<DirListing> TreeState::GetListings()
+{
+	std::lock_guard<std::mutex> guard(_lock);
+	std::vector<DirListing> listings;
+	listings.reserve(_dirs.size());
+	for (auto& [path, dir] : _dirs) {
+		DirListing& listing = listings.emplace_back();
+		listing.path = path;
+		listing.mtime = dir.mtime;
+		listing.files.assign(dir.files.begin(), dir.files.end());
+		listing.dirs.assign(dir.dirs.begin(), dir.dirs.end());
+	}
+	return listings;
+}
@@ -0,0 +1,539 @@
+#include "UringExecutor.h"
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+
+#ifdef __linux__
+#	include <cerrno>
+#	include <fcntl.h>
+#	include <linux/io_uring.h>
+#	include <sys/mman.h>
+#	include <sys/stat.h>
+#	include <sys/syscall.h>
+#	include <unistd.h>
+#endif
+
+#ifdef __linux__
+namespace
+{
+	enum Op : uint8_t
+	{
+		OpenInput = 1,
+		StatInput,
+		OpenOutput,
+		Read,
+		Write,
+		CloseInput,
+		CloseOutput,
+	};
+
+	unsigned Load(unsigned* value)
+	{
+		return std::atomic_ref<unsigned>(*value).load(std::memory_order_acquire);
+	}
+
+	void Store(unsigned* value, unsigned data)
+	{
+		std::atomic_ref<unsigned>(*value).store(data, std::memory_order_release);
+	}
+}
+
+struct UringExecutor::Ring
+{
+	int fd = -1;
+	void* sq = MAP_FAILED;
+	size_t sqSize = 0;
+	void* cq = MAP_FAILED;
+	size_t cqSize = 0;
+	void* sqes = MAP_FAILED;
+	size_t sqesSize = 0;
+
+	unsigned* sqHead = nullptr;
+	unsigned* sqTail = nullptr;
+	unsigned* sqArray = nullptr;
+	unsigned sqMask = 0;
+	unsigned sqEntries = 0;
+
+	unsigned* cqHead = nullptr;
+	unsigned* cqTail = nullptr;
+	io_uring_cqe* cqes = nullptr;
+	unsigned cqMask = 0;
+
+	/// <summary>
+	/// submission tail that has not yet been published to the kernel
+	/// </summary>
+	unsigned tail = 0;
+	unsigned submitted = 0;
+
+	~Ring()
+	{
+		if (sqes != MAP_FAILED)
+			munmap(sqes, sqesSize);
+		if (cq != MAP_FAILED && cq != sq)
+			munmap(cq, cqSize);
+		if (sq != MAP_FAILED)
+			munmap(sq, sqSize);
+		if (fd >= 0)
+			close(fd);
+	}
+
+	bool Setup(unsigned entries)
+	{
+		io_uring_params params;
+		memset(&params, 0, sizeof(params));
+		fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+		if (fd < 0)
+			return false;
+		sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+		cqSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+		bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+		if (single)
+			sqSize = cqSize = std::max(sqSize, cqSize);
+		sq = mmap(nullptr, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+		if (sq == MAP_FAILED)
+			return false;
+		cq = single ? sq : mmap(nullptr, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED)
+			return false;
+		sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+		sqes = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+		if (sqes == MAP_FAILED)
+			return false;
+
+		char* sqbase = (char*)sq;
+		sqHead = (unsigned*)(sqbase + params.sq_off.head);
+		sqTail = (unsigned*)(sqbase + params.sq_off.tail);
+		sqArray = (unsigned*)(sqbase + params.sq_off.array);
+		sqMask = *(unsigned*)(sqbase + params.sq_off.ring_mask);
+		sqEntries = *(unsigned*)(sqbase + params.sq_off.ring_entries);
+		char* cqbase = (char*)cq;
+		cqHead = (unsigned*)(cqbase + params.cq_off.head);
+		cqTail = (unsigned*)(cqbase + params.cq_off.tail);
+		cqes = (io_uring_cqe*)(cqbase + params.cq_off.cqes);
+		cqMask = *(unsigned*)(cqbase + params.cq_off.ring_mask);
+		tail = submitted = *sqTail;
+		return true;
+	}
+
+	/// <summary>
+	/// Returns the next free submission entry, nullptr if the queue is full
+	/// </summary>
+	io_uring_sqe* Next()
+	{
+		if (tail - Load(sqHead) >= sqEntries)
+			return nullptr;
+		unsigned index = tail & sqMask;
+		io_uring_sqe* sqe = (io_uring_sqe*)sqes + index;
+		memset(sqe, 0, sizeof(io_uring_sqe));
+		sqArray[index] = index;
+		tail++;
+		return sqe;
+	}
+
+	/// <summary>
+	/// Publishes the new entries and enters the kernel, waits for [wait] completions
+	/// </summary>
+	int Enter(unsigned wait)
+	{
+		Store(sqTail, tail);
+		unsigned count = tail - submitted;
+		while (true) {
+			int result = (int)syscall(__NR_io_uring_enter, fd, count, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+			if (result < 0 && errno == EINTR)
+				continue;
+			if (result > 0)
+				submitted += (unsigned)result;
+			return result < 0 ? -errno : result;
+		}
+	}
+};
+
+struct UringExecutor::File
+{
+	enum class Stage
+	{
+		Idle,
+		Open,
+		Transfer,
+		Write,
+		Close,
+	};
+
+	Stage stage = Stage::Idle;
+	uint64_t tag = 0;
+	std::string source;
+	std::string destination;
+	int input = -1;
+	int output = -1;
+	/// <summary>
+	/// the destination has been created or truncated
+	/// </summary>
+	bool opened = false;
+	int error = 0;
+	/// <summary>
+	/// operations of the current stage that have not completed yet
+	/// </summary>
+	unsigned outstanding = 0;
+	uint64_t offset = 0;
+	uint64_t size = 0;
+	/// <summary>
+	/// requested, read and written bytes of the current chunk
+	/// </summary>
+	uint32_t length = 0;
+	int32_t read = 0;
+	uint32_t written = 0;
+	struct statx stat;
+	char* buffer = nullptr;
+};
+
+void UringExecutor::Prepare(File& file, unsigned index, uint8_t op, uint8_t flags)
+{
+	io_uring_sqe* sqe = _ring->Next();
+	if (sqe == nullptr) {
+		// cannot happen with the ring sized for the depth, but never drop an operation
+		_ring->Enter(0);
+		sqe = _ring->Next();
+	}
+	sqe->flags = flags;
+	sqe->user_data = ((uint64_t)index << 8) | op;
+	switch (op) {
+	case OpenInput:
+		sqe->opcode = IORING_OP_OPENAT;
+		sqe->fd = AT_FDCWD;
+		sqe->addr = (uint64_t)(uintptr_t)file.source.c_str();
+		sqe->open_flags = O_RDONLY | O_CLOEXEC;
+		break;
+	case StatInput:
+		sqe->opcode = IORING_OP_STATX;
+		sqe->fd = AT_FDCWD;
+		sqe->addr = (uint64_t)(uintptr_t)file.source.c_str();
+		sqe->len = STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_ATIME | STATX_MTIME;
+		sqe->off = (uint64_t)(uintptr_t)&file.stat;
+		break;
+	case OpenOutput:
+		sqe->opcode = IORING_OP_OPENAT;
+		sqe->fd = AT_FDCWD;
+		sqe->addr = (uint64_t)(uintptr_t)file.destination.c_str();
+		sqe->len = 0600;
+		sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+		break;
+	case Read:
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = file.input;
+		sqe->addr = (uint64_t)(uintptr_t)file.buffer;
+		sqe->len = file.length;
+		sqe->off = file.offset;
+		break;
+	case Write:
+		sqe->opcode = IORING_OP_WRITE;
+		sqe->fd = file.output;
+		sqe->addr = (uint64_t)(uintptr_t)(file.buffer + file.written);
+		sqe->len = (file.stage == File::Stage::Write ? (uint32_t)file.read : file.length) - file.written;
+		sqe->off = file.offset + file.written;
+		break;
+	case CloseInput:
+		sqe->opcode = IORING_OP_CLOSE;
+		sqe->fd = file.input;
+		break;
+	case CloseOutput:
+		sqe->opcode = IORING_OP_CLOSE;
+		sqe->fd = file.output;
+		break;
+	}
+	file.outstanding++;
+}
+
+void UringExecutor::Open(File& file, unsigned index)
+{
+	file.stage = File::Stage::Open;
+	Prepare(file, index, StatInput, 0);
+	// the destination is only created and truncated once the source could be opened
+	Prepare(file, index, OpenInput, IOSQE_IO_LINK);
+	Prepare(file, index, OpenOutput, 0);
+}
+
+void UringExecutor::Transfer(File& file, unsigned index)
+{
+	if (file.offset >= file.size) {
+		// keep the modification time, otherwise the copy looks newer than the source in the next run
+		struct timespec times[2] = {
+			{ file.stat.stx_atime.tv_sec, file.stat.stx_atime.tv_nsec },
+			{ file.stat.stx_mtime.tv_sec, file.stat.stx_mtime.tv_nsec },
+		};
+		if (futimens(file.output, times) != 0 || fchmod(file.output, file.stat.stx_mode & 07777) != 0)
+			file.error = errno;
+		Close(file, index);
+		return;
+	}
+	file.stage = File::Stage::Transfer;
+	file.length = (uint32_t)std::min<uint64_t>(ChunkSize, file.size - file.offset);
+	file.read = 0;
+	file.written = 0;
+	// a short read fails the link and cancels the write, the rest is written once the read result is known
+	Prepare(file, index, Read, IOSQE_IO_LINK);
+	Prepare(file, index, Write, 0);
+}
+
+void UringExecutor::Rewrite(File& file, unsigned index)
+{
+	file.stage = File::Stage::Write;
+	Prepare(file, index, Write, 0);
+}
+
+void UringExecutor::Close(File& file, unsigned index)
+{
+	file.stage = File::Stage::Close;
+	if (file.input >= 0)
+		Prepare(file, index, CloseInput, 0);
+	if (file.output >= 0)
+		Prepare(file, index, CloseOutput, 0);
+	if (file.outstanding == 0)
+		Handle(index, 0, 0);
+}
+
+void UringExecutor::Handle(unsigned index, uint8_t op, int32_t result)
+{
+	File& file = _files[index];
+	auto fail = [&file](int error) {
+		if (file.error == 0)
+			file.error = error;
+	};
+	switch (op) {
+	case OpenInput:
+		if (result < 0)
+			fail(-result);
+		else
+			file.input = result;
+		break;
+	case StatInput:
+		if (result < 0)
+			fail(-result);
+		else
+			file.size = file.stat.stx_size;
+		break;
+	case OpenOutput:
+		if (result < 0)
+			fail(-result);
+		else {
+			file.output = result;
+			file.opened = true;
+		}
+		break;
+	case Read:
+		file.read = result;
+		if (result < 0)
+			fail(-result);
+		break;
+	case Write:
+		if (result >= 0)
+			file.written += (uint32_t)result;
+		else if (result != -ECANCELED)
+			fail(-result);
+		break;
+	case CloseInput:
+		file.input = -1;
+		break;
+	case CloseOutput:
+		file.output = -1;
+		if (result < 0)
+			fail(-result);
+		break;
+	}
+	if (op != 0)
+		file.outstanding--;
+	if (file.outstanding > 0)
+		return;
+
+	switch (file.stage) {
+	case File::Stage::Open:
+		if (file.error == 0 && !S_ISREG(file.stat.stx_mode))
+			fail(EINVAL);
+		if (file.error != 0)
+			Close(file, index);
+		else
+			Transfer(file, index);
+		break;
+	case File::Stage::Transfer:
+	case File::Stage::Write:
+		if (file.error != 0) {
+			Close(file, index);
+			break;
+		}
+		if (file.written > (uint32_t)file.read) {
+			// the write was not cancelled after a short read, drop what it wrote past the data
+			if (ftruncate(file.output, (off_t)(file.offset + file.read)) != 0) {
+				fail(errno);
+				Close(file, index);
+				break;
+			}
+			file.written = (uint32_t)file.read;
+		}
+		if (file.written < (uint32_t)file.read) {
+			Rewrite(file, index);
+			break;
+		}
+		file.offset += (uint32_t)file.read;
+		// the file has been shortened since the stat, it ends here
+		if ((uint32_t)file.read < file.length)
+			file.size = file.offset;
+		Transfer(file, index);
+		break;
+	case File::Stage::Close:
+		{
+			uint64_t tag = file.tag;
+			int error = file.error;
+			uint64_t bytes = file.offset;
+			// a partial copy with a new time would look up to date in the next run
+			if (error != 0 && file.opened)
+				unlink(file.destination.c_str());
+			file.stage = File::Stage::Idle;
+			file.source.clear();
+			file.destination.clear();
+			_free.push_back(index);
+			_completion(tag, error, bytes);
+		}
+		break;
+	case File::Stage::Idle:
+		break;
+	}
+}
+
+void UringExecutor::Abort(int error)
+{
+	// the ring is torn down first, so that the kernel cancels what it still holds
+	_ring.reset();
+	for (unsigned index = 0; index < _depth; index++) {
+		File& file = _files[index];
+		if (file.stage == File::Stage::Idle)
+			continue;
+		if (file.input >= 0)
+			close(file.input);
+		if (file.output >= 0)
+			close(file.output);
+		file.input = -1;
+		file.output = -1;
+		// the destination may have been created or truncated by an open whose completion is lost
+		unlink(file.destination.c_str());
+		uint64_t tag = file.tag;
+		file.stage = File::Stage::Idle;
+		file.source.clear();
+		file.destination.clear();
+		_free.push_back(index);
+		_completion(tag, error, 0);
+	}
+}
+#else
+struct UringExecutor::Ring
+{
+};
+
+struct UringExecutor::File
+{
+};
+#endif
+
+UringExecutor::UringExecutor(unsigned depth, Completion completion)
+{
+	_depth = depth < 1 ? 1 : depth;
+	_completion = std::move(completion);
+}
+
+UringExecutor::~UringExecutor()
+{
+}
+
+bool UringExecutor::IsSupported()
+{
+#ifdef __linux__
+	static bool supported = []() {
+		Ring ring;
+		return ring.Setup(2);
+	}();
+	return supported;
+#else
+	return false;
+#endif
+}
+
+bool UringExecutor::Init()
+{
+#ifdef __linux__
+	// every file has at most three operations in flight
+	unsigned entries = 8;
+	while (entries < _depth * 4)
+		entries <<= 1;
+	_ring = std::make_unique<Ring>();
+	if (!_ring->Setup(entries)) {
+		_ring.reset();
+		return false;
+	}
+	_files = std::vector<File>(_depth);
+	_buffers = std::make_unique<char[]>(_depth * ChunkSize);
+	_free.clear();
+	for (unsigned i = 0; i < _depth; i++) {
+		_files[i].buffer = _buffers.get() + i * ChunkSize;
+		_free.push_back(_depth - 1 - i);
+	}
+	return true;
+#else
+	return false;
+#endif
+}
+
+void UringExecutor::Submit(const std::filesystem::path& source, const std::filesystem::path& destination, uint64_t tag)
+{
+#ifdef __linux__
+	unsigned index = _free.back();
+	_free.pop_back();
+	File& file = _files[index];
+	file.tag = tag;
+	file.source = source.native();
+	file.destination = destination.native();
+	file.input = -1;
+	file.output = -1;
+	file.opened = false;
+	file.error = 0;
+	file.outstanding = 0;
+	file.offset = 0;
+	file.size = 0;
+	Open(file, index);
+#endif
+}
+
+bool UringExecutor::Run(bool wait)
+{
+#ifdef __linux__
+	if (InFlight() == 0)
+		return true;
+	int result = _ring->Enter(wait ? 1 : 0);
+	if (result < 0 && result != -EBUSY && result != -EAGAIN) {
+		// nothing in flight would ever complete
+		Abort(-result);
+		return false;
+	}
+	unsigned head = *_ring->cqHead;
+	unsigned tail = Load(_ring->cqTail);
+	while (head != tail) {
+		io_uring_cqe* cqe = &_ring->cqes[head & _ring->cqMask];
+		uint64_t data = cqe->user_data;
+		int32_t res = cqe->res;
+		head++;
+		// release the entry before handling it, the handler may queue new operations
+		Store(_ring->cqHead, head);
+		Handle((unsigned)(data >> 8), (uint8_t)(data & 0xFF), res);
+		if (head == tail)
+			tail = Load(_ring->cqTail);
+	}
+#endif
+	return true;
+}
+
+bool UringExecutor::Full()
+{
+	return _free.empty();
+}
+
+size_t UringExecutor::InFlight()
+{
+	return _depth - _free.size();
+}
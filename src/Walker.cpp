@@ -0,0 +1,511 @@
+#include "Walker.h"
+#include <algorithm>
+#include <cstring>
+#include <thread>
+
+#ifdef __linux__
+#	include <dirent.h>
+#	include <fcntl.h>
+#	include <sys/stat.h>
+#	include <sys/syscall.h>
+#	include <unistd.h>
+#endif
+
+namespace
+{
+#ifdef __linux__
+	struct Dirent64
+	{
+		ino64_t d_ino;
+		off64_t d_off;
+		unsigned short d_reclen;
+		unsigned char d_type;
+		char d_name[];
+	};
+
+	/// <summary>
+	/// Converts a native file name into a wide string, without the locale machinery for plain ascii names
+	/// </summary>
+	std::wstring Widen(std::string_view name)
+	{
+		std::wstring wide(name.size(), L'\0');
+		for (size_t i = 0; i < name.size(); i++) {
+			if ((unsigned char)name[i] >= 0x80)
+				return std::filesystem::path(name).wstring();
+			wide[i] = (wchar_t)name[i];
+		}
+		return wide;
+	}
+
+	void Fill(FileInfo& info, const struct stat& st)
+	{
+		info.size = (uint64_t)st.st_size;
+		info.allocated = (uint64_t)st.st_blocks * 512;
+		info.mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+		info.inode = (uint64_t)st.st_ino;
+		info.device = (uint64_t)st.st_dev;
+		info.mode = (uint32_t)st.st_mode;
+		info.links = (uint32_t)st.st_nlink;
+	}
+
+	/// <summary>
+	/// Calls [func] with the name and d_type of every entry of the open directory [fd], except . and ..
+	/// </summary>
+	/// <returns>false if reading the directory failed, errno is set in that case</returns>
+	template <class Func>
+	bool ReadEntries(int fd, std::vector<char>& buffer, Func func)
+	{
+		while (true) {
+			long read = syscall(SYS_getdents64, fd, buffer.data(), buffer.size());
+			if (read < 0)
+				return false;
+			if (read == 0)
+				return true;
+			for (long pos = 0; pos < read;) {
+				Dirent64* dirent = reinterpret_cast<Dirent64*>(buffer.data() + pos);
+				pos += dirent->d_reclen;
+				const char* name = dirent->d_name;
+				if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+					continue;
+				func(name, dirent->d_type);
+			}
+		}
+	}
+#endif
+}
+
+Walker::Walker(int threads)
+{
+	_threads = threads < 1 ? 1 : threads;
+	_deques = std::vector<WorkDeque>(_threads);
+	_results = std::vector<Result>(_threads);
+}
+
+bool Walker::Stat(const std::filesystem::path& path, FileInfo& info)
+{
+#ifdef __linux__
+	struct stat st;
+	if (stat(path.c_str(), &st) != 0)
+		return false;
+	Fill(info, st);
+	return true;
+#else
+	std::error_code err;
+	info = FileInfo();
+	info.size = std::filesystem::file_size(path, err);
+	info.allocated = info.size;
+	if (err)
+		return false;
+	info.mtime = std::filesystem::last_write_time(path, err).time_since_epoch().count();
+	return !err;
+#endif
+}
+
+#ifdef __linux__
+bool Walker::StatAt(int directory, const char* name, FileInfo& info)
+{
+	struct stat st;
+	if (fstatat(directory, name, &st, 0) != 0)
+		return false;
+	Fill(info, st);
+	return true;
+}
+#endif
+
+bool Walker::ReadDirectory(const std::filesystem::path& path, DirListing& listing)
+{
+	listing.files.clear();
+	listing.dirs.clear();
+	listing.mtime = 0;
+#ifdef __linux__
+	int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+	thread_local std::vector<char> buffer(BufferSize);
+	struct stat st;
+	if (fstat(fd, &st) == 0)
+		listing.mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+	bool success = ReadEntries(fd, buffer, [fd, &listing](const char* name, unsigned char) {
+		struct stat st;
+		if (fstatat(fd, name, &st, 0) != 0)
+			return;
+		if (S_ISDIR(st.st_mode))
+			listing.dirs.emplace_back(name);
+		else
+			Fill(listing.files.emplace_back(name, FileInfo()).second, st);
+	});
+	close(fd);
+	return success;
+#else
+	std::error_code err;
+	auto iter = std::filesystem::directory_iterator(path, std::filesystem::directory_options::follow_directory_symlink, err);
+	if (err)
+		return false;
+	listing.mtime = std::filesystem::last_write_time(path, err).time_since_epoch().count();
+	for (auto end = std::filesystem::directory_iterator(); iter != end; iter.increment(err)) {
+		if (err)
+			return false;
+		try {
+			std::string name = Manifest::Encode(iter->path().filename().wstring());
+			if (iter->is_directory(err))
+				listing.dirs.push_back(std::move(name));
+			else {
+				FileInfo info;
+				info.size = iter->file_size(err);
+				info.allocated = info.size;
+				info.mtime = iter->last_write_time(err).time_since_epoch().count();
+				listing.files.emplace_back(std::move(name), info);
+			}
+		} catch (std::exception& e) {
+			printf("ERROR: %s\n", e.what());
+		}
+	}
+	return true;
+#endif
+}
+
+void Walker::SetCache(const Manifest* cache)
+{
+	_cache = cache != nullptr && cache->IsLoaded() ? cache : nullptr;
+}
+
+void Walker::RecordListings(bool record)
+{
+	_record = record;
+}
+
+std::vector<DirListing> Walker::TakeListings()
+{
+	std::vector<DirListing> listings;
+	for (auto& result : _results) {
+		std::move(result.listings.begin(), result.listings.end(), std::back_inserter(listings));
+		result.listings.clear();
+	}
+	return listings;
+}
+
+size_t Walker::GetReusedDirectories()
+{
+	return _reused.load();
+}
+
+void Walker::Push(int worker, Task task)
+{
+	_pending++;
+	{
+		std::lock_guard<std::mutex> guard(_deques[worker].lock);
+		_deques[worker].tasks.push_back(std::move(task));
+	}
+	_pushed.fetch_add(1);
+	if (_idle.load() > 0)
+		_pushed.notify_one();
+}
+
+bool Walker::Pop(int worker, Task& task)
+{
+	std::lock_guard<std::mutex> guard(_deques[worker].lock);
+	if (_deques[worker].tasks.empty())
+		return false;
+	// newest task first, so the worker stays in the subtree it is currently listing
+	task = std::move(_deques[worker].tasks.back());
+	_deques[worker].tasks.pop_back();
+	return true;
+}
+
+bool Walker::Steal(int worker, Task& task)
+{
+	for (int i = 1; i < _threads; i++) {
+		WorkDeque& victim = _deques[(worker + i) % _threads];
+		std::lock_guard<std::mutex> guard(victim.lock);
+		if (victim.tasks.empty())
+			continue;
+		// oldest task, which is usually the biggest remaining subtree
+		task = std::move(victim.tasks.front());
+		victim.tasks.pop_front();
+		return true;
+	}
+	return false;
+}
+
+void Walker::AddEntry(int worker, const Task& parent, std::filesystem::path path, std::wstring name, bool directory, const FileInfo& info)
+{
+	std::wstring relative;
+	if (parent.relative.empty())
+		relative = std::move(name);
+	else {
+		relative.reserve(parent.relative.size() + 1 + name.size());
+		relative.append(parent.relative).append(1, std::filesystem::path::preferred_separator).append(name);
+	}
+	std::wstring entry = _relative ? relative : _prefix + relative;
+	if (directory) {
+		_results[worker].dirs.push_back(std::move(entry));
+		Push(worker, { std::move(path), std::move(relative) });
+	} else
+		_results[worker].files.push_back({ std::move(entry), info });
+}
+
+#ifdef __linux__
+void Walker::VisitEntry(int worker, const Task& task, int fd, std::string& path, size_t dirlength, const char* name, unsigned char type, const FileInfo* cached, DirListing* listing)
+{
+	bool directory = type == DT_DIR;
+	FileInfo info;
+	if (cached != nullptr)
+		info = *cached;
+	// symlinks are followed like directory_options::follow_directory_symlink does, unknown types need a stat
+	if (_metadata || type == DT_UNKNOWN || type == DT_LNK) {
+		struct stat st;
+		if (fstatat(fd, name, &st, 0) == 0) {
+			directory = S_ISDIR(st.st_mode);
+			Fill(info, st);
+		} else
+			directory = false;
+	}
+	std::string_view sname(name);
+	if (listing != nullptr) {
+		if (directory)
+			listing->dirs.emplace_back(sname);
+		else
+			listing->files.emplace_back(std::string(sname), info);
+	}
+	// the visitor gets the listing, subdirectories are queued once it returns
+	if (_visitor != nullptr)
+		return;
+	path.resize(dirlength);
+	path.append(sname);
+	try {
+		AddEntry(worker, task, directory ? std::filesystem::path(path) : std::filesystem::path(), Widen(sname), directory, info);
+	} catch (std::exception& e) {
+		printf("ERROR: %s: %s\n", path.c_str(), e.what());
+	}
+}
+
+void Walker::ListDirectory(int worker, const Task& task)
+{
+	int fd = open(task.path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
+		printf("ERROR: %s: %s\n", task.path.c_str(), strerror(errno));
+		return;
+	}
+	std::vector<char>& buffer = _results[worker].buffer;
+	if (buffer.size() < BufferSize)
+		buffer.resize(BufferSize);
+
+	std::string path = task.path.native();
+	if (path.empty() == false && path.back() != '/')
+		path.push_back('/');
+	size_t dirlength = path.size();
+
+	DirListing* listing = nullptr;
+	std::string key;
+	int64_t mtime = 0;
+	if (_cache != nullptr || _record || _visitor != nullptr) {
+		struct stat st;
+		if (fstat(fd, &st) == 0)
+			mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+		if (task.path.native().size() > _rootLength)
+			key = task.path.native().substr(_rootLength);
+	}
+	if (_record)
+		listing = &_results[worker].listings.emplace_back();
+	else if (_visitor != nullptr) {
+		listing = &_results[worker].current;
+		listing->files.clear();
+		listing->dirs.clear();
+	}
+	if (listing != nullptr) {
+		listing->path = key;
+		listing->mtime = mtime;
+	}
+
+	size_t count = 0;
+	DirListing& cached = _results[worker].cached;
+	if (_cache != nullptr && _cache->GetListing(key, mtime, cached)) {
+		// no entries have been added or removed since the manifest was written
+		_reused++;
+		for (auto& [name, info] : cached.files)
+			VisitEntry(worker, task, fd, path, dirlength, name.c_str(), DT_REG, &info, listing);
+		for (auto& name : cached.dirs)
+			VisitEntry(worker, task, fd, path, dirlength, name.c_str(), DT_DIR, nullptr, listing);
+		count = cached.files.size() + cached.dirs.size();
+	} else {
+		bool success = ReadEntries(fd, buffer, [&](const char* name, unsigned char type) {
+			count++;
+			VisitEntry(worker, task, fd, path, dirlength, name, type, nullptr, listing);
+		});
+		if (!success)
+			printf("ERROR: %s: %s\n", task.path.c_str(), strerror(errno));
+	}
+	close(fd);
+	_entries += count;
+	if (_visitor != nullptr)
+		VisitDirectory(worker, task, *listing);
+}
+#else
+void Walker::ListDirectory(int worker, const Task& task)
+{
+	std::error_code err;
+	auto iter = std::filesystem::directory_iterator(task.path, std::filesystem::directory_options::follow_directory_symlink, err);
+	if (err) {
+		printf("ERROR: %s: %s\n", task.path.string().c_str(), err.message().c_str());
+		return;
+	}
+	// directory enumeration already returns the metadata here, so the cache is only written and never read
+	DirListing* listing = nullptr;
+	if (_record)
+		listing = &_results[worker].listings.emplace_back();
+	else if (_visitor != nullptr) {
+		listing = &_results[worker].current;
+		listing->files.clear();
+		listing->dirs.clear();
+	}
+	if (listing != nullptr) {
+		listing->path = Manifest::Encode(task.relative);
+		listing->mtime = std::filesystem::last_write_time(task.path, err).time_since_epoch().count();
+	}
+	size_t count = 0;
+	for (auto end = std::filesystem::directory_iterator(); iter != end; iter.increment(err)) {
+		if (err) {
+			printf("ERROR: %s: %s\n", task.path.string().c_str(), err.message().c_str());
+			break;
+		}
+		count++;
+		bool directory = iter->is_directory(err);
+		FileInfo info;
+		if ((_metadata || _visitor != nullptr) && !directory) {
+			// served from the cached find data on windows
+			info.size = iter->file_size(err);
+			info.allocated = info.size;
+			info.mtime = iter->last_write_time(err).time_since_epoch().count();
+		}
+		try {
+			std::wstring name = iter->path().filename().wstring();
+			if (listing != nullptr) {
+				if (directory)
+					listing->dirs.push_back(Manifest::Encode(name));
+				else
+					listing->files.emplace_back(Manifest::Encode(name), info);
+			}
+			if (_visitor == nullptr)
+				AddEntry(worker, task, iter->path(), std::move(name), directory, info);
+		} catch (std::exception& e) {
+			printf("ERROR: %s\n", e.what());
+		}
+	}
+	_entries += count;
+	if (_visitor != nullptr)
+		VisitDirectory(worker, task, *listing);
+}
+#endif
+
+void Walker::VisitDirectory(int worker, const Task& task, const DirListing& listing)
+{
+	try {
+		(*_visitor)(worker, task.relative, listing);
+	} catch (std::exception& e) {
+		printf("ERROR: %s: %s\n", task.path.string().c_str(), e.what());
+	}
+	std::vector<std::string>& skipped = _results[worker].skipped;
+	for (auto& name : listing.dirs) {
+		if (skipped.empty() == false && std::find(skipped.begin(), skipped.end(), name) != skipped.end())
+			continue;
+		try {
+#ifdef __linux__
+			std::wstring wname = Widen(name);
+			std::filesystem::path path = task.path / name;
+#else
+			std::wstring wname = Manifest::Decode(name);
+			std::filesystem::path path = task.path / wname;
+#endif
+			std::wstring relative;
+			if (task.relative.empty())
+				relative = std::move(wname);
+			else
+				relative.append(task.relative).append(1, std::filesystem::path::preferred_separator).append(wname);
+			Push(worker, { std::move(path), std::move(relative) });
+		} catch (std::exception& e) {
+			printf("ERROR: %s: %s\n", task.path.string().c_str(), e.what());
+		}
+	}
+	skipped.clear();
+}
+
+void Walker::Run(int worker)
+{
+	Task task;
+	while (true) {
+		uint32_t ticket = _pushed.load();
+		if (Pop(worker, task) || Steal(worker, task)) {
+			ListDirectory(worker, task);
+			// the last directory releases every idle thread, there is nothing left to wait for
+			if (--_pending == 0) {
+				_pushed.fetch_add(1);
+				_pushed.notify_all();
+			}
+		} else if (_pending.load() == 0) {
+			return;
+		} else {
+			// parked instead of spinning, the visitor may block for a long time while others wait for work
+			_idle++;
+			_pushed.wait(ticket);
+			_idle--;
+		}
+	}
+}
+
+void Walker::Walk(const std::filesystem::path& root, bool relative, bool metadata)
+{
+	_entries = 0;
+	_reused = 0;
+	_relative = relative;
+	_metadata = metadata;
+	_prefix = root.wstring().append(1, std::filesystem::path::preferred_separator);
+	_rootLength = root.native().size();
+	if (root.native().empty() == false && root.native().back() != std::filesystem::path::preferred_separator)
+		_rootLength++;
+	Push(0, { root, std::wstring() });
+
+	std::vector<std::thread> threads;
+	for (int i = 1; i < _threads; i++)
+		threads.emplace_back(&Walker::Run, this, i);
+	Run(0);
+	for (auto& thread : threads)
+		thread.join();
+}
+
+size_t Walker::Walk(const std::filesystem::path& root, std::deque<std::wstring>& outfiles, std::deque<std::wstring>& outdirs, bool relative)
+{
+	Walk(root, relative, false);
+	for (auto& result : _results) {
+		for (auto& file : result.files)
+			outfiles.push_back(std::move(file.path));
+		std::move(result.dirs.begin(), result.dirs.end(), std::back_inserter(outdirs));
+		result.files.clear();
+		result.dirs.clear();
+	}
+	return _entries.load();
+}
+
+void Walker::SkipDirectory(int worker, std::string_view name)
+{
+	_results[worker].skipped.emplace_back(name);
+}
+
+size_t Walker::Walk(const std::filesystem::path& root, const Visitor& visitor)
+{
+	_visitor = &visitor;
+	Walk(root, true, true);
+	_visitor = nullptr;
+	return _entries.load();
+}
+
+size_t Walker::Walk(const std::filesystem::path& root, std::deque<FileEntry>& outfiles, std::deque<std::wstring>& outdirs, bool relative)
+{
+	Walk(root, relative, true);
+	for (auto& result : _results) {
+		std::move(result.files.begin(), result.files.end(), std::back_inserter(outfiles));
+		std::move(result.dirs.begin(), result.dirs.end(), std::back_inserter(outdirs));
+		result.files.clear();
+		result.dirs.clear();
+	}
+	return _entries.load();
+}
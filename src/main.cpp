@@ -85,34 +85,21 @@ std::wstring ToLower(std::wstring s)
 	return s;
 }
 
-void Search(std::filesystem::path path, std::string name)
+void Search(std::filesystem::path path, std::string name, int processors)
 {
 	std::vector<std::wstring> inputs;
-	auto inputiter = std::filesystem::recursive_directory_iterator(path, std::filesystem::directory_options::follow_directory_symlink);
+	std::deque<std::wstring> files;
+	std::deque<std::wstring> dirs;
 	std::wstring wname = ToLower(ConvertToWideString(name).value());
-	long count = 0;
-	try
-	{
-		for (auto const& dir_entry : inputiter) {
-			if (dir_entry.is_directory()) {
-				if (ToLower(dir_entry.path().filename().wstring()).find(wname) != std::string::npos) {
-					//printf("%ws\n", dir_entry.path().wstring().c_str());
-					inputs.push_back(dir_entry.path().wstring());
-				}
-			} else {
-				if (ToLower(dir_entry.path().filename().wstring()).find(wname) != std::string::npos) {
-					//printf("%ws\n", dir_entry.path().wstring().c_str());
-					inputs.push_back(dir_entry.path().wstring());
-				}
+	Functions::GetFiles(path, files, dirs, processors);
+	for (auto const* entries : { &dirs, &files }) {
+		for (auto const& entry : *entries) {
+			size_t pos = entry.find_last_of(std::filesystem::path::preferred_separator);
+			if (ToLower(entry.substr(pos == std::wstring::npos ? 0 : pos + 1)).find(wname) != std::string::npos) {
+				inputs.push_back(entry);
 			}
-			count++;
-			if (count % 10000 == 0)
-				printf("Still Searching...\n");
 		}
 	}
-	catch (std::filesystem::filesystem_error& e) {
-		printf("ERROR: %s\n", e.what());
-	}
 	printf("\n\n\nFOUND\n\n\n");
 	for (auto const& entry : inputs)
 	{
@@ -137,6 +124,20 @@ int main(int argc, char** argv)
 		printf("-m\t\tDeletes source files, after successful copy operation\n");
 		printf("-rm\t\tDeletes files / folders\n");
 		printf("--debug\tPrints debug information\n");
+		printf("--manifest=<FILE>\tReuses unchanged directory listings from FILE and updates it after the copy\n");
+		printf("--trust-manifest=<FILE>\tTakes the state of the output folder from FILE instead of scanning it, and keeps FILE up to date\n");
+		printf("--verify-manifest=<PERCENT>\tChecks PERCENT of the files in the trusted manifest against the output folder\n");
+		printf("--reflink=<auto|always|never>\tClones files instead of copying them on filesystems that support it (default auto)\n");
+		printf("--executor=<threads|uring>\tCopies files with blocking calls per worker, or with io_uring (linux, never clones files). Files of 1 MiB or more, and all files with --reflink=always or --dirty-budget, are copied with blocking calls\n");
+		printf("--uring-depth=<NUM>\tNumber of files each io_uring worker keeps in flight (default 128)\n");
+		printf("--cache-neutral[=<MiB>]\tCopies files of at least MiB (default 64) past the page cache, with O_DIRECT or by dropping copied pages\n");
+		printf("--delta[=<MiB>]\tUpdates existing files of at least MiB (default 64) in place, only changed blocks are written\n");
+		printf("--append\tOnly copies the new tail of files that have grown behind their copy in the Output folder\n");
+		printf("--huge-pages\tBacks the copy buffers of big files with 2 MiB huge pages\n");
+		printf("--dirty-budget=<MiB>\tWrites copied data back in a rolling window, so that each worker leaves at most MiB dirty\n");
+		printf("--detect-renames[=verify]\tWith -d, renames output files without a match to new files of the same size and time instead of copying them, optionally after comparing the content\n");
+		printf("--verify-moves\tWith -m, compares files moved to another filesystem with their source before the source is removed\n");
+		printf("--check-space\tChecks that all files fit into the free space of the Output folder before copying anything\n");
 		printf("-p<NUM>\tNumber of processors to use\n");
 		exit(1);
 	}
@@ -149,11 +150,80 @@ int main(int argc, char** argv)
 	bool debug = false;
 	bool search = false;
 	bool reconstitutesymlinks = false;
+	CopyOptions options;
 	std::vector<std::string> sinodes;
 	for (int i = 1; i < argc; i++) {
 		size_t pos = 0;
 		std::string option = std::string(argv[i]);
-		if (option.find("--debug") != std::string::npos)
+		if (option.starts_with("--manifest="))
+			options.manifest = std::filesystem::path(option.substr(11));
+		else if (option.starts_with("--trust-manifest="))
+			options.destinationManifest = std::filesystem::path(option.substr(17));
+		else if (option.starts_with("--verify-manifest=")) {
+			try {
+				options.verifyManifest = std::stoi(option.substr(18));
+			} catch (std::exception&) {
+			}
+		}
+		else if (option.starts_with("--reflink=")) {
+			if (!CopyEngine::ParseReflink(option.substr(10), options.reflink)) {
+				printf("Unknown reflink mode: %s\n", option.substr(10).c_str());
+				exit(1);
+			}
+		}
+		else if (option.starts_with("--executor=")) {
+			if (option.substr(11) == "uring")
+				options.executor = CopyOptions::Executor::Uring;
+			else if (option.substr(11) == "threads")
+				options.executor = CopyOptions::Executor::Threads;
+			else {
+				printf("Unknown executor: %s\n", option.substr(11).c_str());
+				exit(1);
+			}
+		}
+		else if (option.starts_with("--uring-depth=")) {
+			try {
+				options.uringDepth = (unsigned)std::max(1, std::stoi(option.substr(14)));
+			} catch (std::exception&) {
+			}
+		}
+		else if (option.starts_with("--cache-neutral")) {
+			options.cacheNeutral = true;
+			if (option.starts_with("--cache-neutral=")) {
+				try {
+					options.cacheNeutralSize = std::stoull(option.substr(16)) * 1024 * 1024;
+				} catch (std::exception&) {
+				}
+			}
+		}
+		else if (option.starts_with("--delta")) {
+			options.delta = true;
+			if (option.starts_with("--delta=")) {
+				try {
+					options.deltaSize = std::stoull(option.substr(8)) * 1024 * 1024;
+				} catch (std::exception&) {
+				}
+			}
+		}
+		else if (option.starts_with("--dirty-budget=")) {
+			try {
+				options.dirtyBudget = std::stoull(option.substr(15)) * 1024 * 1024;
+			} catch (std::exception&) {
+			}
+		}
+		else if (option.starts_with("--detect-renames")) {
+			options.detectRenames = true;
+			options.verifyRenames = option == "--detect-renames=verify";
+		}
+		else if (option == "--verify-moves")
+			options.verifyMoves = true;
+		else if (option == "--append")
+			options.append = true;
+		else if (option == "--check-space")
+			options.checkSpace = true;
+		else if (option == "--huge-pages")
+			options.hugePages = true;
+		else if (option.find("--debug") != std::string::npos)
 			debug = true;
 		else if (option.find("-reconstitutesymlinks") != std::string::npos)
 			reconstitutesymlinks = true;
@@ -192,6 +262,27 @@ int main(int argc, char** argv)
 	printf("Delete source files:              %d\n", move);
 	printf("Processors:                       %d\n", processors);
 	printf("Delete files:                     %d\n", remove);
+	if (options.manifest.empty() == false)
+		printf("Manifest:                         %s\n", options.manifest.string().c_str());
+	if (options.destinationManifest.empty() == false)
+		printf("Destination manifest:             %s (verify %d%%)\n", options.destinationManifest.string().c_str(), options.verifyManifest);
+	if (options.executor == CopyOptions::Executor::Uring)
+		printf("Executor:                         io_uring, %u files in flight per worker\n", options.uringDepth);
+	if (options.cacheNeutral)
+		printf("Cache neutral:                    files of at least %llu MiB\n", (unsigned long long)(options.cacheNeutralSize / 1024 / 1024));
+	if (options.delta)
+		printf("Delta updates:                    files of at least %llu MiB\n", (unsigned long long)(options.deltaSize / 1024 / 1024));
+	if (options.detectRenames)
+		printf("Detect renames:                   1%s\n", options.verifyRenames ? ", verified" : "");
+	if (options.verifyMoves)
+		printf("Verify moves:                     1\n");
+	if (options.append)
+		printf("Append tails:                     1\n");
+	if (options.dirtyBudget > 0)
+		printf("Dirty budget:                     %llu MiB per worker\n", (unsigned long long)(options.dirtyBudget / 1024 / 1024));
+	if (options.hugePages)
+		printf("Huge pages:                       1\n");
+	printf("Reflink:                          %s\n", options.reflink == CopyEngine::Reflink::Always ? "always" : options.reflink == CopyEngine::Reflink::Never ? "never" : "auto");
 
 	sInput = std::string(argv[argc - 2]);
 	pathInput = std::filesystem::path(sInput);
@@ -223,7 +314,7 @@ int main(int argc, char** argv)
 			exit(1);
 		}
 		std::string name = std::string(argv[argc - 1]);
-		Search(pathInput, name);
+		Search(pathInput, name, processors);
 	} else if (remove) {
 		std::cout << "Do you really want to delete the files? [Y/N]";
 		std::string resp;
@@ -264,8 +355,8 @@ int main(int argc, char** argv)
 
 
 		Functions func = Functions();
-		std::thread th([&func, &pathInput, &pathOutput, &deletewithoutmatch, &overwriteexisting, &force, &move, &processors]() {
-			func.Copy(pathInput, pathOutput, deletewithoutmatch, overwriteexisting, force, move, processors);
+		std::thread th([&func, &pathInput, &pathOutput, &deletewithoutmatch, &overwriteexisting, &force, &move, &processors, &options]() {
+			func.Copy(pathInput, pathOutput, deletewithoutmatch, overwriteexisting, force, move, processors, options);
 		});
 
 
@@ -275,12 +366,12 @@ int main(int argc, char** argv)
 				finished = true;
 			}
 			if (func._activeCopy)
-				printf("Written Files:\t%5llu / %5llu\t\tSizeWritten:\t%llu / %llu\t %d%%\n", func._filesCopied.load(), func._filesToCopy.load(), func._bytesCopied.load(), func._bytesToCopy.load(), (int)((double)func._bytesCopied.load() / (double)func._bytesToCopy.load() * 100));
+				printf("Written Files:\t%5llu / %5llu\t\tSizeWritten:\t%llu / %llu\t %d%%\tCloned:\t%llu\tPhysical:\t%llu / %llu\n", func._filesCopied.load(), func._filesToCopy.load(), func._bytesCopied.load(), func._bytesToCopy.load(), (int)((double)func._bytesCopied.load() / (double)func._bytesToCopy.load() * 100), (unsigned long long)func._bytesCloned.load(), (unsigned long long)func._physicalBytesCopied.load(), (unsigned long long)func._physicalBytesToCopy.load());
 
 			std::this_thread::sleep_for(std::chrono::milliseconds(1000));
 		}
 		th.join();
-		printf("Written Files:\t%5llu / %5llu\t\tSizeWritten:\t%llu / %llu\t %d%%\n", func._filesCopied.load(), func._filesToCopy.load(), func._bytesCopied.load(), func._bytesToCopy.load(), (int)((double)func._bytesCopied.load() / (double)func._bytesToCopy.load() * 100));
+		printf("Written Files:\t%5llu / %5llu\t\tSizeWritten:\t%llu / %llu\t %d%%\tCloned:\t%llu\tPhysical:\t%llu / %llu\n", func._filesCopied.load(), func._filesToCopy.load(), func._bytesCopied.load(), func._bytesToCopy.load(), (int)((double)func._bytesCopied.load() / (double)func._bytesToCopy.load() * 100), (unsigned long long)func._bytesCloned.load(), (unsigned long long)func._physicalBytesCopied.load(), (unsigned long long)func._physicalBytesToCopy.load());
 
 		printf("Errors: %zd\n", func.errors.size());
 		for (size_t i = 0; i < func.errors.size(); i++) {
@@ -1,9 +1,19 @@
 
+#include "BufferPool.h"
+#include "CopyEngine.h"
+#include "DirectoryCache.h"
 #include "Functions.h"
+#include "MPMCQueue.h"
+#include "Manifest.h"
+#include "UringExecutor.h"
+#include "Walker.h"
 
 #include <iostream>
 #include <filesystem>
+#include <fstream>
+#include <map>
 
+#include <catch2/benchmark/catch_benchmark.hpp>
 #include <catch2/catch_test_macros.hpp>
 #include <catch2/generators/catch_generators.hpp>
 
@@ -35,3 +45,811 @@ TEST_CASE("test Copy", "[copy]")
 	if (rm)
 		std::filesystem::remove_all(L"../../tests_out");
 }
+
+TEST_CASE("test HardLinks", "[copy]")
+{
+	std::filesystem::path input = L"../../tests_links_in";
+	std::filesystem::path output = L"../../tests_links_out";
+	std::filesystem::remove_all(input);
+	std::filesystem::remove_all(output);
+	std::filesystem::create_directories(input / "a");
+	std::filesystem::create_directories(input / "b");
+	{
+		std::ofstream file(input / "a" / "first", std::ios::binary);
+		file << std::string(100000, 'l');
+	}
+	std::filesystem::create_hard_link(input / "a" / "first", input / "a" / "second");
+	std::filesystem::create_hard_link(input / "a" / "first", input / "b" / "third");
+
+	Functions func;
+	func.Copy(input, output, false, false, false, false, 4);
+	REQUIRE(func.errors.empty());
+
+	// every name has to exist, and all of them have to share one inode
+	FileInfo first;
+	REQUIRE(Walker::Stat(output / "a" / "first", first));
+	for (auto name : { L"a/second", L"b/third" }) {
+		FileInfo info;
+		REQUIRE(Walker::Stat(output / name, info));
+		REQUIRE(info.size == first.size);
+#ifdef __linux__
+		REQUIRE(info.inode == first.inode);
+#endif
+	}
+#ifdef __linux__
+	REQUIRE(first.links == 3);
+#endif
+
+	// a name that gets its own file in the input gets its own file in the output, the other names keep their content
+	std::filesystem::remove(input / "a" / "second");
+	{
+		std::ofstream file(input / "a" / "second", std::ios::binary);
+		file << std::string(50000, 'n');
+	}
+	for (int run = 0; run < 2; run++) {
+		Functions again;
+		again.Copy(input, output, false, false, false, false, 4);
+		REQUIRE(again.errors.empty());
+		REQUIRE(again._filesCopied == (run == 0 ? 1 : 0));
+		REQUIRE(std::filesystem::file_size(output / "a" / "second") == 50000);
+		for (auto name : { L"a/first", L"b/third" }) {
+			std::ifstream file(output / name, std::ios::binary);
+			std::string content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+			REQUIRE(content == std::string(100000, 'l'));
+		}
+	}
+
+	std::filesystem::remove_all(input);
+	std::filesystem::remove_all(output);
+}
+
+TEST_CASE("test TrustManifest", "[copy]")
+{
+	std::filesystem::path input = L"../../tests_trust_in";
+	std::filesystem::path output = L"../../tests_trust_out";
+	std::filesystem::path manifest = L"../../tests_trust.manifest";
+	std::filesystem::remove_all(input);
+	std::filesystem::remove_all(output);
+	std::filesystem::remove(manifest);
+	std::filesystem::create_directories(input / "a");
+	std::filesystem::create_directories(input / "b");
+	for (auto name : { "a/one", "a/two", "b/three" }) {
+		std::ofstream file(input / name, std::ios::binary);
+		file << name << std::string(20000, 't');
+	}
+	CopyOptions options;
+	options.destinationManifest = manifest;
+	auto run = [&](int verify) {
+		options.verifyManifest = verify;
+		Functions func;
+		func.Copy(input, output, true, false, false, false, 2, options);
+		REQUIRE(func.errors.empty());
+		REQUIRE(std::filesystem::exists(manifest));
+		return func._filesCopied.load();
+	};
+
+	// the first run scans the output and writes the manifest, the second one takes the output from it
+	REQUIRE(run(0) == 3);
+	REQUIRE(run(0) == 0);
+
+	// only the changed file is copied and only the file without a match is deleted
+	{
+		std::ofstream file(input / "a" / "one", std::ios::binary);
+		file << std::string(30000, 'c');
+	}
+	std::filesystem::remove(input / "b" / "three");
+	REQUIRE(run(0) == 1);
+	REQUIRE(std::filesystem::file_size(output / "a" / "one") == 30000);
+	REQUIRE(!std::filesystem::exists(output / "b" / "three"));
+	REQUIRE(run(0) == 0);
+
+	// a file removed behind the back of the manifest is only noticed if the manifest is verified
+	std::filesystem::remove(output / "a" / "two");
+	REQUIRE(run(0) == 0);
+	REQUIRE(!std::filesystem::exists(output / "a" / "two"));
+	REQUIRE(run(100) == 1);
+	REQUIRE(std::filesystem::file_size(output / "a" / "two") == std::filesystem::file_size(input / "a" / "two"));
+	REQUIRE(run(100) == 0);
+
+	std::filesystem::remove_all(input);
+	std::filesystem::remove_all(output);
+	std::filesystem::remove(manifest);
+}
+
+TEST_CASE("test CheckSpace", "[copy]")
+{
+	std::filesystem::path input = L"../../tests_space_in";
+	std::filesystem::path output = L"../../tests_space_out";
+	std::filesystem::path manifest = L"../../tests_space_in.manifest";
+	std::filesystem::path destination = L"../../tests_space_out.manifest";
+	std::filesystem::remove_all(input);
+	std::filesystem::remove_all(output);
+	std::filesystem::create_directories(input);
+	for (auto name : { "one", "two" }) {
+		std::ofstream file(input / name, std::ios::binary);
+		file << name << std::string(20000, 's');
+	}
+	CopyOptions options;
+	options.checkSpace = true;
+	options.manifest = manifest;
+	options.destinationManifest = destination;
+	Functions func;
+	func.Copy(input, output, true, false, false, false, 2, options);
+	REQUIRE(func.errors.empty());
+	REQUIRE(func._filesCopied == 2);
+
+	// a rejected run copies nothing, but keeps both manifests
+	{
+		std::ofstream file(input / "three", std::ios::binary);
+		file << std::string(20000, 's');
+	}
+	Functions rejected;
+	rejected._assumedSpace = 1;
+	rejected.Copy(input, output, true, false, false, false, 2, options);
+	REQUIRE(rejected.errors.size() == 1);
+	REQUIRE(rejected._filesCopied == 0);
+	REQUIRE(!std::filesystem::exists(output / "three"));
+	REQUIRE(std::filesystem::exists(manifest));
+	REQUIRE(std::filesystem::exists(destination));
+
+	Functions again;
+	again.Copy(input, output, true, false, false, false, 2, options);
+	REQUIRE(again.errors.empty());
+	REQUIRE(again._filesCopied == 1);
+	REQUIRE(std::filesystem::file_size(output / "three") == 20000);
+
+	std::filesystem::remove_all(input);
+	std::filesystem::remove_all(output);
+	std::filesystem::remove(manifest);
+	std::filesystem::remove(destination);
+}
+
+TEST_CASE("test DetectRenames", "[copy]")
+{
+	std::filesystem::path input = L"../../tests_renames_in";
+	std::filesystem::path output = L"../../tests_renames_out";
+	std::filesystem::remove_all(input);
+	std::filesystem::remove_all(output);
+	std::filesystem::create_directories(input / "old");
+	// the sizes differ, both files may get the same timestamp and would be an ambiguous match otherwise
+	for (auto name : { "one", "three" }) {
+		std::ofstream file(input / "old" / name, std::ios::binary);
+		file << name << std::string(50000, 'r');
+	}
+	Functions func;
+	func.Copy(input, output, true, false, false, false, 2);
+	FileInfo before;
+	REQUIRE(Walker::Stat(output / "old" / "one", before));
+
+	// a renamed directory and a file moved to another directory are renamed in the output as well
+	std::filesystem::create_directories(input / "other");
+	std::filesystem::rename(input / "old" / "three", input / "other" / "three");
+	std::filesystem::rename(input / "old", input / "new");
+	CopyOptions options;
+	options.detectRenames = true;
+	options.verifyRenames = GENERATE(false, true);
+	Functions renames;
+	renames.Copy(input, output, true, false, false, false, 2, options);
+	REQUIRE(renames.errors.empty());
+	REQUIRE(renames._filesCopied == 0);
+	REQUIRE(!std::filesystem::exists(output / "old"));
+	FileInfo after;
+	REQUIRE(Walker::Stat(output / "new" / "one", after));
+	REQUIRE(after.inode == before.inode);
+	REQUIRE(std::filesystem::file_size(output / "other" / "three") == std::filesystem::file_size(input / "other" / "three"));
+
+	std::filesystem::remove_all(input);
+	std::filesystem::remove_all(output);
+}
+
+TEST_CASE("test MoveDirectories", "[copy]")
+{
+	std::filesystem::path input = L"../../tests_move_in";
+	std::filesystem::path output = L"../../tests_move_out";
+	std::filesystem::remove_all(input);
+	std::filesystem::remove_all(output);
+	for (auto dir : { "shared", "new/deep/deeper" })
+		std::filesystem::create_directories(input / dir);
+	std::filesystem::create_directories(output / "shared");
+	for (auto name : { "shared/a", "shared/b", "new/c", "new/deep/d", "new/deep/deeper/e" }) {
+		std::ofstream file(input / name, std::ios::binary);
+		file << name;
+	}
+	FileInfo before;
+	REQUIRE(Walker::Stat(input / "new" / "deep" / "d", before));
+
+	// only the files of the directory that exists on both sides are moved one by one
+	Functions func;
+	func.Copy(input, output, false, false, false, true, 3);
+	REQUIRE(func.errors.empty());
+	REQUIRE(func._filesCopied == 2);
+	REQUIRE(!std::filesystem::exists(input / "new"));
+	REQUIRE(!std::filesystem::exists(input / "shared" / "a"));
+	FileInfo after;
+	REQUIRE(Walker::Stat(output / "new" / "deep" / "d", after));
+	REQUIRE(after.inode == before.inode);
+	REQUIRE(std::filesystem::exists(output / "new" / "deep" / "deeper" / "e"));
+	REQUIRE(std::filesystem::exists(output / "shared" / "b"));
+
+	std::filesystem::remove_all(input);
+	std::filesystem::remove_all(output);
+}
+
+#ifdef __linux__
+TEST_CASE("test MoveAcrossFilesystems", "[copy]")
+{
+	std::filesystem::path input = L"../../tests_xdev_in";
+	std::filesystem::path output = L"/dev/shm/tests_xdev_out";
+	std::filesystem::remove_all(input);
+	std::filesystem::remove_all(output);
+	std::filesystem::create_directories(input / "sub");
+	for (auto name : { "a", "b", "sub/c" }) {
+		std::ofstream file(input / name, std::ios::binary);
+		file << name << std::string(10000, 'x');
+	}
+	std::filesystem::create_directories(output);
+	FileInfo in, out;
+	if (!Walker::Stat(input / "a", in) || !Walker::Stat(output, out) || in.device == out.device) {
+		WARN("no second filesystem at /dev/shm");
+		std::filesystem::remove_all(input);
+		return;
+	}
+
+	// the sources are only removed after their copies have been verified and synced
+	CopyOptions options;
+	options.verifyMoves = true;
+	Functions func;
+	func.Copy(input, output, false, false, false, true, 2, options);
+	REQUIRE(func.errors.empty());
+	REQUIRE(func._filesCopied == 3);
+	for (auto name : { "a", "b", "sub/c" }) {
+		REQUIRE(!std::filesystem::exists(input / name));
+		REQUIRE(std::filesystem::file_size(output / name) == 10000 + std::string(name).size());
+	}
+
+	std::filesystem::remove_all(input);
+	std::filesystem::remove_all(output);
+}
+#endif
+
+TEST_CASE("test BufferPool", "[copy]")
+{
+	BufferPool pool;
+	REQUIRE(BufferPool::Classify(0) == BufferPool::SizeClass::Small);
+	REQUIRE(BufferPool::Classify(10 * 1024 * 1024) == BufferPool::SizeClass::Medium);
+	REQUIRE(BufferPool::Classify(1ull << 40) == BufferPool::SizeClass::Large);
+	for (int i = 0; i < (int)BufferPool::SizeClass::Count; i++) {
+		BufferPool::Buffer buffer = pool.Acquire((BufferPool::SizeClass)i);
+		REQUIRE((uintptr_t)buffer.Data() % BufferPool::Alignment == 0);
+		REQUIRE(buffer.Size() % BufferPool::Alignment == 0);
+	}
+	// every class has been used once, from now on the buffers are reused
+	uint64_t allocations = BufferPool::GetAllocations();
+	for (int i = 0; i < 100; i++) {
+		BufferPool::Buffer first = pool.Acquire(BufferPool::SizeClass::Large);
+		BufferPool::Buffer second = pool.Acquire(BufferPool::SizeClass::Small);
+		REQUIRE(first.Data() != second.Data());
+	}
+	REQUIRE(BufferPool::GetAllocations() == allocations);
+}
+
+TEST_CASE("test CopyEngine", "[copy]")
+{
+	std::filesystem::path source = L"../../tests_engine_in";
+	std::filesystem::path destination = L"../../tests_engine_out";
+	// bigger than the read/write buffer, so that every method needs several calls
+	const size_t bufferSize = BufferPool::GetSize(BufferPool::SizeClass::Medium);
+	std::string data(bufferSize * 3 + 17, '\0');
+	for (size_t i = 0; i < data.size(); i++)
+		data[i] = (char)(i * 31 + i / 4096);
+	{
+		std::ofstream file(source, std::ios::binary);
+		file.write(data.data(), data.size());
+	}
+	{
+		// existing content has to be replaced
+		std::ofstream file(destination, std::ios::binary);
+		file << std::string(bufferSize * 5, 'x');
+	}
+
+	CopyEngine engine;
+	CopyEngine::Method method = engine.Copy(source, destination);
+	REQUIRE(engine.GetStatistics(method).files == 1);
+	REQUIRE(engine.GetStatistics(method).bytes == data.size());
+
+	std::ifstream file(destination, std::ios::binary);
+	std::string copied((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	REQUIRE(copied == data);
+	REQUIRE(std::filesystem::last_write_time(source) == std::filesystem::last_write_time(destination));
+	file.close();
+
+	REQUIRE_THROWS_AS(engine.Copy(L"../../tests_engine_missing", destination), std::filesystem::filesystem_error);
+
+	engine.SetReflink(CopyEngine::Reflink::Never);
+	method = engine.Copy(source, destination);
+	REQUIRE(method != CopyEngine::Method::Clone);
+	REQUIRE(method != CopyEngine::Method::CopyFileRange);
+	REQUIRE(std::filesystem::file_size(destination) == data.size());
+
+	// past the page cache, the unaligned tail has to be cut off again
+	engine.SetCacheNeutral(true, 0);
+	method = engine.Copy(source, destination);
+	REQUIRE((method == CopyEngine::Method::Direct || method == CopyEngine::Method::DropBehind));
+	file.open(destination, std::ios::binary);
+	copied.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+	REQUIRE(copied == data);
+	file.close();
+	engine.SetCacheNeutral(false, 0);
+
+	// several threads share the chunks, exactly one of them finishes the file
+	std::filesystem::remove(destination);
+	engine.SetReflink(CopyEngine::Reflink::Auto);
+	auto split = engine.OpenSplit(source, destination, 64 * 1024);
+	REQUIRE(split->GetSize() == data.size());
+	std::atomic<int> finishers = 0;
+	std::vector<std::thread> threads;
+	for (int i = 0; i < 3; i++) {
+		threads.emplace_back([&]() {
+			if (engine.CopySplit(*split)) {
+				finishers++;
+				engine.FinishSplit(*split);
+			}
+		});
+	}
+	for (auto& thread : threads)
+		thread.join();
+	REQUIRE(finishers == 1);
+	REQUIRE(split->IsClaimed());
+	file.open(destination, std::ios::binary);
+	copied.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+	REQUIRE(copied == data);
+	REQUIRE(std::filesystem::last_write_time(source) == std::filesystem::last_write_time(destination));
+	file.close();
+
+#ifdef __linux__
+	// only the changed blocks are rewritten, in place and by the threads of a split alike
+	auto change = [&](size_t offset) {
+		data[offset] ^= 1;
+		std::ofstream changed(source, std::ios::binary);
+		changed.write(data.data(), data.size());
+	};
+	engine.ResetStatistics();
+	engine.SetReflink(CopyEngine::Reflink::Never);
+	engine.SetDelta(true, 0);
+	change(bufferSize + 5);
+	method = engine.Copy(source, destination);
+	REQUIRE(method == CopyEngine::Method::Delta);
+	REQUIRE(engine.GetStatistics(method).bytes == CopyEngine::DeltaBlockSize);
+	change(bufferSize * 2);
+	split = engine.OpenSplit(source, destination, 64 * 1024);
+	REQUIRE(engine.CopySplit(*split));
+	engine.FinishSplit(*split);
+	REQUIRE(engine.GetStatistics(CopyEngine::Method::Delta).bytes == CopyEngine::DeltaBlockSize * 2);
+	file.open(destination, std::ios::binary);
+	copied.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+	REQUIRE(copied == data);
+	REQUIRE(std::filesystem::last_write_time(source) == std::filesystem::last_write_time(destination));
+	file.close();
+	engine.SetDelta(false, 0);
+
+	// a grown file only gets its tail, a file that has also changed before the old end is copied as a whole
+	auto readDestination = [&]() {
+		file.open(destination, std::ios::binary);
+		copied.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+		file.close();
+		return copied;
+	};
+	engine.ResetStatistics();
+	engine.SetAppend(true);
+	std::filesystem::resize_file(destination, data.size() - 1000);
+	method = engine.Copy(source, destination);
+	REQUIRE(method == CopyEngine::Method::Append);
+	REQUIRE(engine.GetStatistics(method).bytes == 1000);
+	REQUIRE(readDestination() == data);
+	std::filesystem::resize_file(destination, data.size() - 1000);
+	change(10);
+	method = engine.Copy(source, destination);
+	REQUIRE(method != CopyEngine::Method::Append);
+	REQUIRE(readDestination() == data);
+	engine.SetAppend(false);
+
+	// a clone replaces a longer destination completely, a failed one leaves no stale file behind
+	engine.SetReflink(CopyEngine::Reflink::Always);
+	std::filesystem::resize_file(destination, data.size() * 2);
+	bool cloned = true;
+	try {
+		engine.Copy(source, destination);
+	} catch (const std::filesystem::filesystem_error&) {
+		cloned = false;
+	}
+	if (cloned)
+		REQUIRE(readDestination() == data);
+	else
+		REQUIRE(!std::filesystem::exists(destination));
+	// a split file is cloned as a whole before any chunk is copied
+	{
+		std::ofstream longer(destination, std::ios::binary);
+		longer << std::string(data.size() * 2, 'x');
+	}
+	if (cloned) {
+		split = engine.OpenSplit(source, destination, 64 * 1024);
+		REQUIRE(split->IsCloned());
+		REQUIRE(engine.CopySplit(*split));
+		REQUIRE(engine.FinishSplit(*split) == CopyEngine::Method::Clone);
+		REQUIRE(readDestination() == data);
+	} else {
+		REQUIRE_THROWS_AS(engine.OpenSplit(source, destination, 64 * 1024), std::filesystem::filesystem_error);
+		REQUIRE(!std::filesystem::exists(destination));
+	}
+	engine.SetReflink(CopyEngine::Reflink::Auto);
+
+	// a hole in front of and behind the data, only the data is copied and the holes are kept
+	std::filesystem::remove(destination);
+	const size_t sparseSize = 16 * 1024 * 1024;
+	std::filesystem::resize_file(source, 0);
+	std::filesystem::resize_file(source, sparseSize);
+	{
+		std::fstream sparse(source, std::ios::binary | std::ios::in | std::ios::out);
+		sparse.seekp(sparseSize / 2);
+		sparse.write(data.data(), bufferSize);
+	}
+	FileInfo info;
+	REQUIRE(Walker::Stat(source, info));
+	if (!CopyEngine::IsSparse(info.size, info.allocated)) {
+		WARN("filesystem does not support sparse files");
+	} else {
+		method = engine.Copy(source, destination);
+		REQUIRE(method == CopyEngine::Method::Sparse);
+		REQUIRE(Walker::Stat(destination, info));
+		REQUIRE(info.size == sparseSize);
+		REQUIRE(info.allocated < sparseSize / 2);
+		file.open(destination, std::ios::binary);
+		copied.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+		REQUIRE(copied.size() == sparseSize);
+		REQUIRE(copied.compare(sparseSize / 2, bufferSize, data, 0, bufferSize) == 0);
+		REQUIRE(copied.find_first_not_of('\0', sparseSize / 2 + bufferSize) == std::string::npos);
+		file.close();
+	}
+#endif
+
+	std::filesystem::remove(source);
+	std::filesystem::remove(destination);
+}
+
+TEST_CASE("test UringExecutor", "[copy]")
+{
+	if (!UringExecutor::IsSupported()) {
+		WARN("io_uring is not available");
+		return;
+	}
+
+	std::filesystem::path directory = L"../../tests_uring";
+	std::filesystem::create_directories(directory);
+	// several chunks with a short last one, and an empty file
+	std::string data(UringExecutor::ChunkSize * 3 + 17, '\0');
+	for (size_t i = 0; i < data.size(); i++)
+		data[i] = (char)(i * 31 + i / 4096);
+	{
+		std::ofstream file(directory / L"big", std::ios::binary);
+		file.write(data.data(), data.size());
+		std::ofstream empty(directory / L"empty", std::ios::binary);
+	}
+
+	std::map<uint64_t, std::pair<int, uint64_t>> results;
+	UringExecutor executor(2, [&results](uint64_t tag, int error, uint64_t bytes) {
+		results[tag] = { error, bytes };
+	});
+	REQUIRE(executor.Init());
+	executor.Submit(directory / L"big", directory / L"big.out", 1);
+	executor.Submit(directory / L"empty", directory / L"empty.out", 2);
+	REQUIRE(executor.Full());
+	while (executor.InFlight() > 0)
+		executor.Run(true);
+	executor.Submit(directory / L"missing", directory / L"missing.out", 3);
+	// the destination is created before the source turns out not to be a file, and removed again
+	executor.Submit(directory, directory / L"directory.out", 4);
+	while (executor.InFlight() > 0)
+		executor.Run(true);
+
+	REQUIRE(results.size() == 4);
+	REQUIRE(results[1] == std::pair<int, uint64_t>(0, data.size()));
+	REQUIRE(results[2] == std::pair<int, uint64_t>(0, 0));
+	REQUIRE(results[3].first == ENOENT);
+	REQUIRE(results[4].first == EINVAL);
+	REQUIRE(!std::filesystem::exists(directory / L"directory.out"));
+
+	std::ifstream file(directory / L"big.out", std::ios::binary);
+	std::string copied((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	REQUIRE(copied == data);
+	REQUIRE(std::filesystem::last_write_time(directory / L"big") == std::filesystem::last_write_time(directory / L"big.out"));
+	REQUIRE(std::filesystem::file_size(directory / L"empty.out") == 0);
+	file.close();
+
+	std::filesystem::remove_all(directory);
+}
+
+TEST_CASE("test DirectoryCache", "[copy]")
+{
+	DirectoryCache cache(2);
+	int first = cache.Get(L"../../tests");
+#ifdef __linux__
+	REQUIRE(first >= 0);
+	REQUIRE(cache.Get(L"../../tests") == first);
+	REQUIRE(cache.Get(L"../..") >= 0);
+	REQUIRE(cache.Size() == 2);
+	// the least recently used directory is closed
+	REQUIRE(cache.Get(L"..") >= 0);
+	REQUIRE(cache.Size() == 2);
+	REQUIRE(cache.Get(L"../../tests_missing") == -1);
+	REQUIRE(cache.Size() == 2);
+#else
+	REQUIRE(first == -1);
+#endif
+	REQUIRE(DirectoryCache::GetCapacity(4, 64) >= 2);
+}
+
+TEST_CASE("test GetFiles", "[walker]")
+{
+	auto processors = GENERATE(1, 2, 4, 8);
+
+	std::set<std::wstring> filesexpected;
+	std::set<std::wstring> dirsexpected;
+	for (auto const& dir_entry : std::filesystem::recursive_directory_iterator(L"../../tests", std::filesystem::directory_options::follow_directory_symlink)) {
+		if (dir_entry.is_directory())
+			dirsexpected.insert(dir_entry.path().wstring());
+		else
+			filesexpected.insert(dir_entry.path().wstring());
+	}
+
+	std::deque<std::wstring> files;
+	std::deque<std::wstring> dirs;
+	size_t entries = Functions::GetFiles(L"../../tests", files, dirs, processors);
+
+	REQUIRE(entries == filesexpected.size() + dirsexpected.size());
+	REQUIRE(std::set<std::wstring>(files.begin(), files.end()) == filesexpected);
+	REQUIRE(std::set<std::wstring>(dirs.begin(), dirs.end()) == dirsexpected);
+}
+
+TEST_CASE("test Manifest", "[manifest]")
+{
+	std::filesystem::path file(L"../../tests_manifest");
+
+	std::deque<FileEntry> files;
+	std::deque<std::wstring> dirs;
+	Walker walker(2);
+	walker.RecordListings(true);
+	walker.Walk(L"../../tests", files, dirs);
+	std::vector<DirListing> listings = walker.TakeListings();
+	REQUIRE(listings.size() == dirs.size() + 1);
+	// pretend the manifest was written later, so that no directory is considered racy
+	REQUIRE(Manifest::Write(file, listings, Manifest::Now() + 60ll * 1000000000));
+
+	Manifest manifest;
+	REQUIRE(manifest.Load(file));
+	REQUIRE(manifest.GetDirectoryCount() == listings.size());
+	REQUIRE(manifest.GetFileCount() == files.size());
+
+	for (auto& listing : listings) {
+		DirListing cached;
+		REQUIRE(manifest.GetListing(listing.path, listing.mtime, cached));
+		REQUIRE(cached.path == listing.path);
+		REQUIRE(cached.dirs == listing.dirs);
+		REQUIRE(cached.files.size() == listing.files.size());
+		for (size_t i = 0; i < cached.files.size(); i++) {
+			REQUIRE(cached.files[i].first == listing.files[i].first);
+			REQUIRE(cached.files[i].second.size == listing.files[i].second.size);
+			REQUIRE(cached.files[i].second.mtime == listing.files[i].second.mtime);
+		}
+		REQUIRE_FALSE(manifest.GetListing(listing.path, listing.mtime + 1, cached));
+	}
+	REQUIRE_FALSE(manifest.GetListing("does not exist", 0, listings[0]));
+
+	std::deque<FileEntry> filescached;
+	std::deque<std::wstring> dirscached;
+	Walker cachedwalker(2);
+	cachedwalker.SetCache(&manifest);
+	cachedwalker.Walk(L"../../tests", filescached, dirscached);
+#ifdef __linux__
+	REQUIRE(cachedwalker.GetReusedDirectories() == listings.size());
+#endif
+	REQUIRE(filescached.size() == files.size());
+	REQUIRE(dirscached.size() == dirs.size());
+
+	manifest.Unload();
+	std::filesystem::remove(file);
+}
+
+TEST_CASE("benchmark GetFiles", "[.][benchmark]")
+{
+	// point SYNCFILES_BENCH_DIR at a big tree, the test data is too small for meaningful numbers
+	const char* env = std::getenv("SYNCFILES_BENCH_DIR");
+	std::filesystem::path root = env ? std::filesystem::path(env) : std::filesystem::path(L"../../tests");
+
+	BENCHMARK("recursive_directory_iterator")
+	{
+		std::deque<std::wstring> files;
+		std::deque<std::wstring> dirs;
+		for (auto const& dir_entry : std::filesystem::recursive_directory_iterator(root, std::filesystem::directory_options::follow_directory_symlink)) {
+			if (dir_entry.is_directory())
+				dirs.push_back(dir_entry.path().wstring());
+			else
+				files.push_back(dir_entry.path().wstring());
+		}
+		return files.size() + dirs.size();
+	};
+
+	for (int processors : { 1, 4, 16 }) {
+		BENCHMARK("GetFiles -p" + std::to_string(processors))
+		{
+			std::deque<std::wstring> files;
+			std::deque<std::wstring> dirs;
+			return Functions::GetFiles(root, files, dirs, processors);
+		};
+	}
+}
+
+TEST_CASE("test MPMCQueue", "[queue]")
+{
+	auto threads = GENERATE(1, 2, 4, 8);
+	const size_t count = 100000;
+	MPMCQueue<size_t> queue(64);
+
+	std::atomic<size_t> sum = 0;
+	std::atomic<size_t> popped = 0;
+	std::atomic<size_t> rejected = 0;
+	std::vector<std::thread> consumers;
+	for (int i = 0; i < threads; i++) {
+		consumers.emplace_back([&queue, &sum, &popped]() {
+			size_t value;
+			while (queue.Pop(value)) {
+				sum += value;
+				popped++;
+			}
+		});
+	}
+	std::vector<std::thread> producers;
+	for (int i = 0; i < threads; i++) {
+		producers.emplace_back([&queue, &rejected, i, threads, count]() {
+			for (size_t value = i; value < count; value += threads) {
+				if (!queue.Push(size_t(value)))
+					rejected++;
+			}
+		});
+	}
+	for (auto& thread : producers)
+		thread.join();
+	queue.Close();
+	for (auto& thread : consumers)
+		thread.join();
+
+	REQUIRE(rejected == 0);
+	REQUIRE(popped == count);
+	REQUIRE(sum == count * (count - 1) / 2);
+	REQUIRE(queue.Push(size_t(1)) == false);
+	size_t value;
+	REQUIRE(queue.Pop(value) == false);
+}
+
+TEST_CASE("benchmark MPMCQueue", "[.][benchmark]")
+{
+	const size_t count = 100000;
+
+	for (int threads : { 1, 2, 4, 8, 16, 32, 64 }) {
+		BENCHMARK("ts_deque " + std::to_string(threads) + " threads")
+		{
+			ts_deque<size_t> queue;
+			std::atomic<bool> done = false;
+			std::atomic<size_t> popped = 0;
+			std::vector<std::thread> consumers;
+			for (int i = 0; i < threads; i++) {
+				consumers.emplace_back([&]() {
+					// the way the workers used to poll their queues
+					while (!done || !queue.empty()) {
+						try {
+							queue.get_pop_front();
+							popped++;
+						} catch (std::exception&) {
+						}
+					}
+				});
+			}
+			std::vector<std::thread> producers;
+			for (int i = 0; i < threads; i++) {
+				producers.emplace_back([&, i]() {
+					for (size_t value = i; value < count; value += threads)
+						queue.push_back(value);
+				});
+			}
+			for (auto& thread : producers)
+				thread.join();
+			done = true;
+			for (auto& thread : consumers)
+				thread.join();
+			return popped.load();
+		};
+
+		BENCHMARK("MPMCQueue " + std::to_string(threads) + " threads")
+		{
+			MPMCQueue<size_t> queue(1024);
+			std::atomic<size_t> popped = 0;
+			std::vector<std::thread> consumers;
+			for (int i = 0; i < threads; i++) {
+				consumers.emplace_back([&]() {
+					size_t value;
+					while (queue.Pop(value))
+						popped++;
+				});
+			}
+			std::vector<std::thread> producers;
+			for (int i = 0; i < threads; i++) {
+				producers.emplace_back([&, i]() {
+					for (size_t value = i; value < count; value += threads)
+						queue.Push(size_t(value));
+				});
+			}
+			for (auto& thread : producers)
+				thread.join();
+			queue.Close();
+			for (auto& thread : consumers)
+				thread.join();
+			return popped.load();
+		};
+	}
+}
+
+TEST_CASE("benchmark UringExecutor", "[.][benchmark]")
+{
+	// many small files, where the thread-per-job model is bound by syscall latency
+	std::filesystem::path directory = L"../../tests_uring_bench";
+	const int count = 2000;
+	std::filesystem::create_directories(directory / L"in");
+	std::filesystem::create_directories(directory / L"out");
+	for (int i = 0; i < count; i++) {
+		std::ofstream file(directory / L"in" / std::to_string(i), std::ios::binary);
+		file << std::string(4096 + i, 'a');
+	}
+
+	for (int threads : { 1, 4, 16 }) {
+		BENCHMARK("CopyEngine " + std::to_string(threads) + " threads")
+		{
+			CopyEngine engine;
+			std::atomic<int> next = 0;
+			std::vector<std::thread> workers;
+			for (int t = 0; t < threads; t++) {
+				workers.emplace_back([&]() {
+					for (int i = next++; i < count; i = next++)
+						engine.Copy(directory / L"in" / std::to_string(i), directory / L"out" / std::to_string(i));
+				});
+			}
+			for (auto& thread : workers)
+				thread.join();
+			return engine.GetStatistics(CopyEngine::Method::CopyFileRange).files.load();
+		};
+	}
+
+	if (!UringExecutor::IsSupported())
+		return;
+	for (unsigned depth : { 1, 8, 64, 256 }) {
+		BENCHMARK("UringExecutor depth " + std::to_string(depth))
+		{
+			int copied = 0;
+			UringExecutor executor(depth, [&copied](uint64_t, int error, uint64_t) {
+				if (error == 0)
+					copied++;
+			});
+			executor.Init();
+			for (int i = 0; i < count;) {
+				while (i < count && !executor.Full()) {
+					executor.Submit(directory / L"in" / std::to_string(i), directory / L"out" / std::to_string(i), i);
+					i++;
+				}
+				executor.Run(true);
+			}
+			while (executor.InFlight() > 0)
+				executor.Run(true);
+			return copied;
+		};
+	}
+
+	std::filesystem::remove_all(directory);
+}